@@ -0,0 +1,89 @@
+/*
+	This file is part of floppyThing, a floppy imaging tool.
+	Copyright 2020 Mads Thore Theodor Hansen
+
+    floppyThing is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    floppyThing is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* The board is selected by the makefile with BOARD=<name>, which defines
+BOARD_<NAME>. Each board header provides the clock setup and the pin map.
+The index and read data pins are given as pin numbers, LINE_INDEX and
+LINE_READDATA, and their pin masks, exti lines and interrupt handlers are
+made from those below. */
+#if defined(BOARD_DISCOVERY)
+#include "board_discovery.h"
+#elif defined(BOARD_BLACKPILL)
+#include "board_blackpill.h"
+#else
+#error "No board selected, build with BOARD=discovery or BOARD=blackpill"
+#endif
+
+#define BOARD_CAT(a, b)			a##b
+#define BOARD_CAT3(a, b, c)		a##b##c
+#define BOARD_XCAT(a, b)		BOARD_CAT(a, b)
+#define BOARD_XCAT3(a, b, c)	BOARD_CAT3(a, b, c)
+
+#define PIN_INDEX		BOARD_XCAT(GPIO, LINE_INDEX)
+#define EXTI_INDEX		BOARD_XCAT(EXTI, LINE_INDEX)
+#define PIN_READDATA	BOARD_XCAT(GPIO, LINE_READDATA)
+#define EXTI_READDATA	BOARD_XCAT(EXTI, LINE_READDATA)
+
+// libopencm3 numbers exti lines the same way as pins, EXTIn == GPIOn
+_Static_assert(EXTI_INDEX == PIN_INDEX, "index exti line does not match its pin");
+_Static_assert(EXTI_READDATA == PIN_READDATA, "read data exti line does not match its pin");
+
+/* Exti 0 to 4 have a vector each, 5 to 9 share one and so do 10 to 15. The
+two handlers below are separate functions, so they can not share one. */
+#define EXTI_VECTOR(line)	((line) <= 4 ? (line) : ((line) <= 9 ? 5 : 10))
+
+#if EXTI_VECTOR(LINE_INDEX) == EXTI_VECTOR(LINE_READDATA)
+#error "index and read data are on exti lines that share an interrupt vector"
+#endif
+
+#if LINE_INDEX <= 4
+#define NVIC_INDEX_IRQ		BOARD_XCAT3(NVIC_EXTI, LINE_INDEX, _IRQ)
+#define index_isr			BOARD_XCAT3(exti, LINE_INDEX, _isr)
+#elif LINE_INDEX <= 9
+#define NVIC_INDEX_IRQ		NVIC_EXTI9_5_IRQ
+#define index_isr			exti9_5_isr
+#else
+#define NVIC_INDEX_IRQ		NVIC_EXTI15_10_IRQ
+#define index_isr			exti15_10_isr
+#endif
+
+#if LINE_READDATA <= 4
+#define NVIC_READDATA_IRQ	BOARD_XCAT3(NVIC_EXTI, LINE_READDATA, _IRQ)
+#define readdata_isr		BOARD_XCAT3(exti, LINE_READDATA, _isr)
+#elif LINE_READDATA <= 9
+#define NVIC_READDATA_IRQ	NVIC_EXTI9_5_IRQ
+#define readdata_isr		exti9_5_isr
+#else
+#define NVIC_READDATA_IRQ	NVIC_EXTI15_10_IRQ
+#define readdata_isr		exti15_10_isr
+#endif
+
+// where the out buffer goes, boards that need it elsewhere than ram say so
+#ifndef BOARD_OUT_BUFFER_SECTION
+#define BOARD_OUT_BUFFER_SECTION
+#endif
+
+/* Pin access through the set/reset and input data registers. Ports and
+pins are constants, so each of these compile to a single store or load,
+which is what we want in the interrupt handlers. */
+#define PIN_HIGH(name)	(GPIO_BSRR(PORT_##name) = PIN_##name)
+#define PIN_LOW(name)	(GPIO_BSRR(PORT_##name) = ((uint32_t)PIN_##name << 16))
+#define PIN_READ(name)	(GPIO_IDR(PORT_##name) & PIN_##name)
+
+// clear a pending exti request, the register is write 1 to clear
+#define EXTI_CLEAR(line)	(EXTI_PR = (line))
@@ -0,0 +1,66 @@
+/*
+	This file is part of floppyThing, a floppy imaging tool.
+	Copyright 2020 Mads Thore Theodor Hansen
+
+    floppyThing is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    floppyThing is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*	STM32F401CC "black pill" with a 25MHz crystal, stand in for the
+	smaller custom board. Index and read data sit on exti 0 and 1, which
+	have interrupt vectors of their own, so the handlers never share. */
+
+#define BOARD_NAME		"blackpill"
+#define BOARD_CLOCK		(&rcc_hse_25mhz_3v3[RCC_CLOCK_3V3_84MHZ])
+#define BOARD_AHB_HZ	84000000
+#define BOARD_TIMER_HZ	84000000	// APB1 timer clock, used by TIM3
+#define BOARD_OUT_BUFFER_SIZE	32768	// half the ram, most of a dd revolution
+
+//	pin and port definitions
+#define PORT_DENSEL		GPIOB
+#define PIN_DENSEL		GPIO12
+#define PORT_INDEX		GPIOB
+#define LINE_INDEX		1	// pin number, also its exti line
+#define PORT_MOTOR1		GPIOB
+#define PIN_MOTOR1		GPIO13
+#define PORT_DRVSEL2	GPIOB
+#define PIN_DRVSEL2		GPIO14
+#define PORT_DRVSEL1	GPIOB
+#define PIN_DRVSEL1		GPIO15
+#define PORT_MOTOR2		GPIOA
+#define PIN_MOTOR2		GPIO8
+#define PORT_DIR		GPIOB
+#define PIN_DIR			GPIO4
+#define PORT_STEP		GPIOB
+#define PIN_STEP		GPIO5
+#define PORT_TRACK0		GPIOB
+#define PIN_TRACK0		GPIO7
+#define PORT_WRTPRO		GPIOB
+#define PIN_WRTPRO		GPIO8
+#define PORT_READDATA	GPIOB
+#define LINE_READDATA	0	// pin number, also its exti line
+#define PORT_SIDESEL	GPIOB
+#define PIN_SIDESEL		GPIO6
+#define PORT_DISKCH		GPIOB
+#define PIN_DISKCH		GPIO9
+#define PORT_LED		GPIOC	// blue user led, active low
+#define PIN_LED			GPIO13
+
+#define LED_ON()		PIN_LOW(LED)
+
+static inline void board_gpio_clocks(void)
+{
+	// GPIOA is enabled in main for the usb pins
+	rcc_periph_clock_enable(RCC_GPIOB);
+	rcc_periph_clock_enable(RCC_GPIOC);
+}
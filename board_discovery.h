@@ -0,0 +1,67 @@
+/*
+	This file is part of floppyThing, a floppy imaging tool.
+	Copyright 2020 Mads Thore Theodor Hansen
+
+    floppyThing is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    floppyThing is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+//	STM32F4 Discovery, STM32F407VG with an 8MHz crystal
+
+#define BOARD_NAME		"discovery"
+#define BOARD_CLOCK		(&rcc_hse_8mhz_3v3[RCC_CLOCK_3V3_168MHZ])
+#define BOARD_AHB_HZ	168000000
+#define BOARD_TIMER_HZ	84000000	// APB1 timer clock, used by TIM3
+#define BOARD_OUT_BUFFER_SIZE	131072	// all of sram, an hd revolution and then some
+#define BOARD_OUT_BUFFER_SECTION	__attribute__((section(".out_buffer")))	// see stm32f407xg.ld
+
+//	pin and port definitions
+#define PORT_DENSEL		GPIOH
+#define PIN_DENSEL		GPIO1
+#define PORT_INDEX		GPIOC
+#define LINE_INDEX		15	// pin number, also its exti line
+#define PORT_MOTOR1		GPIOC
+#define PIN_MOTOR1		GPIO13
+#define PORT_DRVSEL2	GPIOE
+#define PIN_DRVSEL2		GPIO5
+#define PORT_DRVSEL1	GPIOE
+#define PIN_DRVSEL1		GPIO3
+#define PORT_MOTOR2		GPIOE
+#define PIN_MOTOR2		GPIO1
+#define PORT_DIR		GPIOB
+#define PIN_DIR			GPIO9
+#define PORT_STEP		GPIOB
+#define PIN_STEP		GPIO7
+#define PORT_TRACK0		GPIOB
+#define PIN_TRACK0		GPIO5
+#define PORT_WRTPRO		GPIOB
+#define PIN_WRTPRO		GPIO3
+#define PORT_READDATA	GPIOD
+#define LINE_READDATA	6	// pin number, also its exti line
+#define PORT_SIDESEL	GPIOD
+#define PIN_SIDESEL		GPIO4
+#define PORT_DISKCH		GPIOD
+#define PIN_DISKCH		GPIO2
+#define PORT_LED		GPIOD	// green user led
+#define PIN_LED			GPIO12
+
+#define LED_ON()		PIN_HIGH(LED)
+
+static inline void board_gpio_clocks(void)
+{
+	rcc_periph_clock_enable(RCC_GPIOB);
+	rcc_periph_clock_enable(RCC_GPIOC);
+	rcc_periph_clock_enable(RCC_GPIOD);
+	rcc_periph_clock_enable(RCC_GPIOE);
+	rcc_periph_clock_enable(RCC_GPIOH);
+}
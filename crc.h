@@ -0,0 +1,84 @@
+/*
+	This file is part of floppyThing, a floppy imaging tool.
+	Copyright 2020 Mads Thore Theodor Hansen
+
+    floppyThing is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    floppyThing is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Crc32 over the capture stream, fed 32 bit words at a time. On the
+STM32F4 this uses the crc unit, which has a fixed setup: polynomial
+0x04C11DB7, initial value 0xFFFFFFFF, no bit reflection and no final xor.
+Words are loaded little endian from the stream bytes. Other builds get a
+software version that gives the same result. */
+
+#include <stdint.h>
+
+#ifdef STM32F4
+
+#include <libopencm3/stm32/crc.h>
+
+static inline void frame_crc_reset(void)
+{
+	CRC_CR |= CRC_CR_RESET;
+}
+
+static inline void frame_crc_add(const uint32_t *words, uint32_t count)
+{
+	while(count--)
+	{
+		CRC_DR = *words++;
+	}
+}
+
+static inline uint32_t frame_crc_value(void)
+{
+	return CRC_DR;
+}
+
+#else
+
+static uint32_t frame_crc = 0xFFFFFFFF;
+
+static inline void frame_crc_reset(void)
+{
+	frame_crc = 0xFFFFFFFF;
+}
+
+static inline void frame_crc_add(const uint32_t *words, uint32_t count)
+{
+	uint8_t bit;
+	
+	while(count--)
+	{
+		frame_crc ^= *words++;
+		for(bit = 0; bit < 32; bit++)
+		{
+			if(frame_crc & 0x80000000)
+			{
+				frame_crc = (frame_crc << 1) ^ 0x04C11DB7;
+			}
+			else
+			{
+				frame_crc <<= 1;
+			}
+		}
+	}
+}
+
+static inline uint32_t frame_crc_value(void)
+{
+	return frame_crc;
+}
+
+#endif
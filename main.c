@@ -21,11 +21,16 @@
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/desig.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/cdc.h>
 
+#include "board.h"
+#include "crc.h"
+#include "trace.h"
 #include "usb_consts.h"
 
 //	pc to mcu protocol
@@ -37,6 +42,14 @@
 #define CMD_MOTOR			0x05	// cmd on/off
 #define CMD_READ 			0x06	// cmd
 #define CMD_READ_MULTI 		0x07	// cmd times
+#define CMD_READ_STOP		0x08	// cmd
+#define CMD_READ_UNTIL		0x09	// cmd max_times
+#define CMD_DETECT_DENSITY	0x0A	// cmd
+#define CMD_SURVEY			0x0B	// cmd last_cylinder, at most LAST_CYLINDER
+#define CMD_RESEND_FRAME	0x0C	// cmd frame(2)
+#define CMD_READ_WINDOW		0x0D	// cmd start(3) length(3), in capture ticks after the index
+#define CMD_TRACE_DUMP		0x0E	// cmd
+#define CMD_SERIAL			0x0F	// cmd
 #define CMD_HANDSHAKE		0x69
 
 //	mcu to pc protocol
@@ -49,6 +62,22 @@
 #define MSG_DISK_LOADED		0xC6
 #define MSG_DISK_EJECTED	0xC7
 #define MSG_INDEX_TIMEOUT	0xC8
+#define MSG_STREAM_HEADER	0xC9	// followed by the density
+#define MSG_DENSITY			0xCA	// followed by the density
+#define MSG_SURVEY			0xCB	// followed by the rest of a survey_report
+#define MSG_FRAME_CRC		0xCC	// followed by the frame number(2) and crc32(4), little endian
+#define MSG_RESEND_FAILED	0xCD	// the frame has been overwritten in the out buffer
+#define MSG_WINDOW_START	0xCE
+#define MSG_TRACE			0xCF	// followed by the rest of a trace_header and the events
+#define MSG_FRAME_END		0xD0	// last byte of a frame that is not the last
+#define MSG_SERIAL			0xD1	// followed by the 24 character usb serial number
+#define MSG_FRAME_OVERRUN	0xD2	// like MSG_FRAME_CRC, the frame was overwritten before it was sent
+
+//	densities, a bit cell is 16.8 timer ticks for dd and hd, and 21 for ed
+#define DENSITY_DD			0x00	// 8.4MHz timer
+#define DENSITY_HD			0x01	// 16.8MHz timer
+#define DENSITY_ED			0x02	// 42MHz timer
+#define DENSITY_UNKNOWN		0x03	// too few transitions to tell, the old density is kept
 
 #define EVENT_STEP_TICK		0x01
 #define EVENT_STEP_TOCK		0x02
@@ -61,35 +90,19 @@
 #define STATE_STEP_DONE		0x03
 #define STATE_SPINUP		0x04
 #define STATE_READ			0x05
+#define STATE_DETECT		0x06
+#define STATE_DETECT_DONE	0x07
+#define STATE_SURVEY		0x08
+#define STATE_SURVEY_DONE	0x09
+#define STATE_WINDOW_WAIT	0x0A
+#define STATE_WINDOW		0x0B
+
+#define LAST_CYLINDER		79		// of an 80 track drive
 
+//	interval histogram, 48 bins of 4 timer ticks covers the whole timer range
+#define HISTOGRAM_BINS		48
+#define HISTOGRAM_SHIFT		2
 
-//	pin and port definitions
-#define PORT_DENSEL		GPIOH
-#define PIN_DENSEL		GPIO1
-#define PORT_INDEX		GPIOC
-#define PIN_INDEX		GPIO15
-#define PORT_MOTOR1		GPIOC
-#define PIN_MOTOR1		GPIO13
-#define PORT_DRVSEL2	GPIOE
-#define PIN_DRVSEL2		GPIO5
-#define PORT_DRVSEL1	GPIOE
-#define PIN_DRVSEL1		GPIO3
-#define PORT_MOTOR2		GPIOE
-#define PIN_MOTOR2		GPIO1
-#define PORT_DIR		GPIOB
-#define PIN_DIR			GPIO9
-#define PORT_STEP		GPIOB
-#define PIN_STEP		GPIO7
-#define PORT_TRACK0		GPIOB
-#define PIN_TRACK0		GPIO5
-#define PORT_WRTPRO		GPIOB
-#define PIN_WRTPRO		GPIO3
-#define PORT_READDATA	GPIOD
-#define PIN_READDATA	GPIO6
-#define PORT_SIDESEL	GPIOD
-#define PIN_SIDESEL		GPIO4
-#define PORT_DISKCH		GPIOD
-#define PIN_DISKCH		GPIO2
 
 // global variables go here
 uint8_t control_buffer[128];
@@ -106,10 +119,38 @@ uint8_t events[16];*/
 uint8_t state = STATE_DONE;
 uint32_t state_time = 0;
 
-//	buffer and support variables for outgoing data.
-uint8_t out_buffer[128];
-uint8_t out_position;
-uint8_t	out_count;
+/*	All changes of state go through here, the ones in the interrupts too,
+	so the trace has every one of them. */
+static inline void state_set(uint8_t new_state)
+{
+	state = new_state;
+	TRACE_EVENT(TRACE_STATE, new_state);
+}
+
+/*	Buffer and support variables for outgoing data. The positions count
+	bytes since the start of the stream, and wrap around the buffer when
+	indexing. The interrupts only move out_position, the main loop only
+	out_sent.
+	A read stream is split in frames, one before the first index pulse and
+	one for each revolution after it. A frame ends with MSG_FRAME_END, or
+	MSG_DONE for the last one. The interrupts only note where it ends, the
+	main loop sends it, the tail in a short packet, and then MSG_FRAME_CRC.
+	A frame can be sent again as long as the data after it has not wrapped
+	over it. If the interrupts wrap over data that is not sent yet, the
+	frame gets MSG_FRAME_OVERRUN instead. */
+#define OUT_BUFFER_SIZE		BOARD_OUT_BUFFER_SIZE	// must be a power of two
+#define OUT_BUFFER_MASK		(OUT_BUFFER_SIZE - 1)
+#define FRAME_MAX			260		// 255 revolutions, the lead in and the last index pulse
+_Static_assert((OUT_BUFFER_SIZE & OUT_BUFFER_MASK) == 0, "out buffer size must be a power of two");
+uint8_t out_buffer[OUT_BUFFER_SIZE] BOARD_OUT_BUFFER_SECTION __attribute__((aligned(4)));
+volatile uint32_t out_position;
+uint32_t out_sent;
+volatile uint32_t frame_ends[FRAME_MAX];	// out_position after each closed frame
+volatile uint16_t frames_closed = 0;
+uint16_t frames_sent = 0;				// frames with their crc sent
+uint32_t frame_crcs[FRAME_MAX];
+uint8_t frame_overrun = 0;				// part of the frame being sent was lost
+volatile uint8_t stream_open = 0;		// set until the last frame is closed
 
 //	track start with 0 being the outermost track on side 0, and track 1
 //	being the outermost track on side 1
@@ -123,6 +164,37 @@ uint8_t parameter = 0;
 uint8_t index_state = 0;
 uint8_t index_count = 0;
 uint8_t read_target = 0;
+uint8_t read_minimum = 0;		// revolutions to capture before a stop request is honoured
+volatile uint8_t read_stop = 0;	// set by the host to end the read at the next index pulse
+uint8_t density = DENSITY_HD;
+uint8_t saved_density;	// restored after sampling at the hd timebase
+uint8_t disk_ejected = 0;	// latched when disk change goes low, cleared by check_disk
+
+//	when histogram_mode is set the read data handler bins intervals instead
+//	of sending them. Intervals that overflowed the timer are not counted.
+volatile uint8_t histogram_mode = 0;
+uint8_t histogram_overflow = 0;
+uint32_t histogram[HISTOGRAM_BINS];
+uint32_t histogram_transitions;
+uint32_t histogram_start_cycles;	// DWT_CYCCNT at the first index pulse
+uint32_t histogram_period_cycles;	// cycles between the two index pulses
+
+//	survey progress, the sweep goes head 0 then 1 on each cylinder
+uint8_t surveying = 0;
+uint8_t survey_cylinder;
+uint8_t survey_head;
+uint8_t survey_last;
+
+//	Sent for every track surveyed. The histogram is at the hd timebase,
+//	each bin is 4 timer ticks, and the counts saturate at 0xffff.
+struct survey_report {
+	uint8_t message;		// MSG_SURVEY
+	uint8_t cylinder;
+	uint8_t head;
+	uint32_t index_period;	// in microseconds
+	uint32_t transitions;	// flux transitions in the revolution
+	uint16_t histogram[HISTOGRAM_BINS];
+} __attribute__((packed));
 
 void sys_tick_handler(void)
 {
@@ -136,16 +208,51 @@ static inline uint32_t next_time(uint32_t delay)
 
 static inline void message_add(uint8_t message)
 {
-	if(out_position >= 127)
-	{
-		out_position = 0;
-	}
-	else
+	out_buffer[out_position & OUT_BUFFER_MASK] = message;
+	out_position++;
+}
+
+// start a new stream and its first frame, the last stream has been sent
+static inline void stream_begin(void)
+{
+	out_position = 0;
+	out_sent = 0;
+	frames_closed = 0;
+	frames_sent = 0;
+	frame_overrun = 0;
+	stream_open = 1;
+	frame_crc_reset();
+	message_add(MSG_STREAM_HEADER);
+	message_add(density);
+}
+
+// close the current frame with MSG_FRAME_END, or MSG_DONE for the last one,
+// out_buffer_poll sends it
+static inline void frame_end(uint8_t message)
+{
+	message_add(message);
+	frame_ends[frames_closed] = out_position;
+	frames_closed++;
+}
+
+static inline void stream_end(void)
+{
+	frame_end(MSG_DONE);
+	stream_open = 0;
+}
+
+/*	Stops the capture timer. An overflow that is already pending is queued
+	here, so it lands before the count and the marker that follow, and not
+	after them once this handler returns. */
+static inline void capture_timer_stop(void)
+{
+	TIM3_CR1 &= ~1;	// disable timer
+	if(TIM3_SR & TIM_SR_UIF)
 	{
-		out_position++;
+		TIM3_SR = ~TIM_SR_UIF;
+		nvic_clear_pending_irq(NVIC_TIM3_IRQ);
+		message_add(MSG_OVERFLOW);
 	}
-	out_buffer[out_position] = message;
-	out_count++;
 }
 
 static inline void serial_send_byte(uint8_t byte)
@@ -153,6 +260,27 @@ static inline void serial_send_byte(uint8_t byte)
 	while(usbd_ep_write_packet(usb_device, 0x82, (char *)&byte, 1) == 0);
 }
 
+static inline void serial_send_pair(uint8_t message, uint8_t value)
+{
+	uint8_t buffer[2] = {message, value};
+	while(usbd_ep_write_packet(usb_device, 0x82, (char *)buffer, 2) == 0);
+}
+
+// send a buffer of any length, split into full size packets
+void serial_send(const void *data, uint16_t length)
+{
+	const uint8_t *position = data;
+	uint16_t packet;
+	
+	while(length)
+	{
+		packet = length > 64 ? 64 : length;
+		while(usbd_ep_write_packet(usb_device, 0x82, position, packet) == 0);
+		position += packet;
+		length -= packet;
+	}
+}
+
 /*void event_add(uint8_t event, uint32_t delay)
 {
 	uint8_t pos = next_event + event_count;
@@ -170,15 +298,15 @@ static inline void serial_send_byte(uint8_t byte)
 void drive(uint8_t drive)
 {
 	current_drive = drive;
-	gpio_set(PORT_DRVSEL1, PIN_DRVSEL1);
-	gpio_set(PORT_DRVSEL2, PIN_DRVSEL2);
+	PIN_HIGH(DRVSEL1);
+	PIN_HIGH(DRVSEL2);
 	if(drive == 1)
 	{
-		gpio_clear(PORT_DRVSEL1, PIN_DRVSEL1);
+		PIN_LOW(DRVSEL1);
 	}
 	else if(drive == 2)
 	{
-		gpio_clear(PORT_DRVSEL2, PIN_DRVSEL2);
+		PIN_LOW(DRVSEL2);
 	}
 	serial_send_byte(MSG_DONE);
 }
@@ -186,23 +314,23 @@ void drive(uint8_t drive)
 void cylinder(uint8_t cylinder)
 {
 	target_cylinder = cylinder;
-	if(target_cylinder > 79)
-		gpio_set(GPIOD, GPIO12);
+	if(target_cylinder > LAST_CYLINDER)
+		LED_ON();
 	if(cylinder == 0)
 	{
-		if(gpio_get(PORT_TRACK0, PIN_TRACK0))
+		if(PIN_READ(TRACK0))
 		{
-			gpio_set(PORT_DIR, PIN_DIR);
+			PIN_HIGH(DIR);
 			current_dir = 0;
-			gpio_clear(PORT_STEP, PIN_STEP);
+			PIN_LOW(STEP);
 			//event_add(EVENT_STEP_TOCK, 60);
-			state = STATE_STEP_TICK;
+			state_set(STATE_STEP_TICK);
 			state_time = next_time(60);
 		}
 		else
 		{
 			current_cylinder = 0;
-			state = STATE_STEP_DONE;
+			state_set(STATE_STEP_DONE);
 			state_time = next_time(10);
 		}
 	}
@@ -210,17 +338,17 @@ void cylinder(uint8_t cylinder)
 	{
 		if(cylinder > current_cylinder)
 		{
-			gpio_clear(PORT_DIR, PIN_DIR);
+			PIN_LOW(DIR);
 			current_dir = 1;
 		}
 		else
 		{
-			gpio_set(PORT_DIR, PIN_DIR);
+			PIN_HIGH(DIR);
 			current_dir = 0;
 		}
-		gpio_clear(PORT_STEP, PIN_STEP);
+		PIN_LOW(STEP);
 		//event_add(EVENT_STEP_TOCK, 60);
-		state = STATE_STEP_TICK;
+		state_set(STATE_STEP_TICK);
 		state_time = next_time(60);
 	}
 }
@@ -229,72 +357,260 @@ void head(uint8_t head)
 {
 	if(head)
 	{
-		gpio_clear(PORT_SIDESEL, PIN_SIDESEL);
+		PIN_LOW(SIDESEL);
 	}
 	else
 	{
-		gpio_set(PORT_SIDESEL, PIN_SIDESEL);
+		PIN_HIGH(SIDESEL);
 	}
 	serial_send_byte(MSG_DONE);
 }
 
+/*	Reports MSG_DISK_EJECTED once if the disk has been out since the last
+	check, so a host resuming an imaging job knows it may be a new disk,
+	even if it lost the connection while it happened. */
 void check_disk()
 {
-	if(gpio_get(PORT_DISKCH, PIN_DISKCH) == 0)
+	if(PIN_READ(DISKCH) == 0)
 	{
 		serial_send_byte(MSG_NO_DISK);
 	}
+	else if(disk_ejected)
+	{
+		disk_ejected = 0;
+		serial_send_byte(MSG_DISK_EJECTED);
+	}
 	else
 	{
 		serial_send_byte(MSG_DISK_LOADED);
 	}
 }
 
+void disk_poll()
+{
+	if(current_drive && (PIN_READ(DISKCH) == 0))
+	{
+		disk_ejected = 1;
+	}
+}
+
 void motor(uint8_t motor_state)
 {
 	if(current_drive == 1)
 	{
 		if(motor_state)
 		{
-			gpio_clear(PORT_MOTOR1, PIN_MOTOR1);
+			PIN_LOW(MOTOR1);
 			//event_add(EVENT_MOTOR_READY, 10000);
-			state = STATE_SPINUP;
+			state_set(STATE_SPINUP);
 			state_time = next_time(10000);
 		}
 		else
 		{
-			gpio_set(PORT_MOTOR1, PIN_MOTOR1);
+			PIN_HIGH(MOTOR1);
 		}
 	}
 	if(current_drive == 2)
 	{
 		if(motor_state)
 		{
-			gpio_clear(PORT_MOTOR2, PIN_MOTOR2);
+			PIN_LOW(MOTOR2);
 			//event_add(EVENT_MOTOR_READY, 10000);
-			state = STATE_SPINUP;
+			state_set(STATE_SPINUP);
 			state_time = next_time(10000);
 		}
 		else
 		{
-			gpio_set(PORT_MOTOR2, PIN_MOTOR2);
+			PIN_HIGH(MOTOR2);
 		}
 	}
 }
 
-void read(uint8_t count)
+void density_set(uint8_t new_density)
 {
-	state = STATE_READ;
+	density = new_density;
+	switch(density)
+	{
+		case DENSITY_DD:
+			PIN_HIGH(DENSEL);
+			TIM3_PSC = (BOARD_TIMER_HZ / 8400000) - 1;
+			break;
+		case DENSITY_HD:
+			PIN_LOW(DENSEL);
+			TIM3_PSC = (BOARD_TIMER_HZ / 16800000) - 1;
+			break;
+		case DENSITY_ED:
+			// ed drives take the hd level on densel
+			PIN_LOW(DENSEL);
+			TIM3_PSC = (BOARD_TIMER_HZ / 42000000) - 1;
+			break;
+	}
+	TIM3_EGR = TIM_EGR_UG;	// load the prescaler now, URS keeps this from interrupting
+}
+
+/*	Picks the density from the interval histogram of one revolution. The
+	shortest mfm interval, 2 bit cells, is the most common one, and at the
+	hd timebase it is 17 ticks for ed, 34 for hd and 67 for dd. Fm disks
+	have a 4us shortest interval, and come out as dd. */
+uint8_t density_classify()
+{
+	uint32_t total = 0;
+	uint8_t peak = 0;
+	uint8_t bin;
+	
+	for(bin = 0; bin < HISTOGRAM_BINS; bin++)
+	{
+		total += histogram[bin];
+		if(histogram[bin] > histogram[peak])
+		{
+			peak = bin;
+		}
+	}
+	if(total < 1000)
+	{
+		return DENSITY_UNKNOWN;
+	}
+	if((peak << HISTOGRAM_SHIFT) < 25)
+	{
+		return DENSITY_ED;
+	}
+	if((peak << HISTOGRAM_SHIFT) < 50)
+	{
+		return DENSITY_HD;
+	}
+	return DENSITY_DD;
+}
+
+void histogram_clear()
+{
+	uint8_t bin;
+	
+	for(bin = 0; bin < HISTOGRAM_BINS; bin++)
+	{
+		histogram[bin] = 0;
+	}
+	histogram_overflow = 0;
+	histogram_transitions = 0;
+}
+
+// bin one revolution, from index to index, then go to the matching done state
+void histogram_capture(uint8_t capture_state)
+{
+	histogram_clear();
+	histogram_mode = 1;
+	state_set(capture_state);
+	index_count = 0;
+	state_time = next_time(10000);	// 1s timeout on finding two index pulses
+	exti_set_trigger(EXTI_INDEX, EXTI_TRIGGER_FALLING);
+	exti_enable_request(EXTI_INDEX);
+}
+
+void detect_density()
+{
+	// sample at the hd timebase, all three densities fit in its range
+	saved_density = density;
+	density_set(DENSITY_HD);
+	histogram_capture(STATE_DETECT);
+}
+
+void survey(uint8_t last_cylinder)
+{
+	if(last_cylinder > LAST_CYLINDER)
+	{
+		// the head would step into its stop
+		serial_send_byte(MSG_INVALID_CMD);
+		return;
+	}
+	saved_density = density;
+	density_set(DENSITY_HD);
+	surveying = 1;
+	survey_cylinder = 0;
+	survey_head = 0;
+	survey_last = last_cylinder;
+	PIN_HIGH(SIDESEL);	// head 0
+	cylinder(0);	// the capture starts when the step is done
+}
+
+void survey_send()
+{
+	struct survey_report report;
+	uint8_t bin;
+	
+	report.message = MSG_SURVEY;
+	report.cylinder = survey_cylinder;
+	report.head = survey_head;
+	report.index_period = histogram_period_cycles / (BOARD_AHB_HZ / 1000000);
+	report.transitions = histogram_transitions;
+	for(bin = 0; bin < HISTOGRAM_BINS; bin++)
+	{
+		report.histogram[bin] = histogram[bin] > 0xffff ? 0xffff : histogram[bin];
+	}
+	serial_send(&report, sizeof(report));
+}
+
+// step to the next track of the survey, or finish it
+void survey_next()
+{
+	if(survey_head == 0)
+	{
+		survey_head = 1;
+		PIN_LOW(SIDESEL);
+		histogram_capture(STATE_SURVEY);
+	}
+	else if(survey_cylinder < survey_last)
+	{
+		survey_head = 0;
+		PIN_HIGH(SIDESEL);
+		survey_cylinder++;
+		cylinder(survey_cylinder);
+	}
+	else
+	{
+		surveying = 0;
+		density_set(saved_density);
+		serial_send_byte(MSG_DONE);
+	}
+}
+
+void read(uint8_t count, uint8_t minimum)
+{
+	state_set(STATE_READ);
 	index_count = 0;
 	index_state = 0;
 	read_target = count;
+	read_minimum = minimum;
+	read_stop = 0;
+	histogram_mode = 0;
+	stream_begin();
 	state_time = next_time(10000);	// 1s timeout on finding the index
-	TIM3_CNT = 0xff40;
+	TIM3_CNT = 0xbf;	// like every capture, so counts stay below the messages
 	TIM3_CR1 |= 1; // enable timer
 	// TODO: enable interrupts on index pin
-	exti_set_trigger(EXTI15, EXTI_TRIGGER_FALLING);
-	exti_enable_request(EXTI15);
-	exti_enable_request(EXTI6);
+	exti_set_trigger(EXTI_INDEX, EXTI_TRIGGER_FALLING);
+	exti_enable_request(EXTI_INDEX);
+	exti_enable_request(EXTI_READDATA);
+}
+
+/*	Reads only the part of the track from start to start + length, both in
+	capture timer ticks after the next index pulse, the unit of the stream
+	intervals at the current density. TIM2 times the window from the index
+	at the same rate, and read data is only enabled inside it. */
+void read_window(uint32_t start, uint32_t length)
+{
+	if(start == 0)
+	{
+		start = 1;	// a compare on 0 would not match until the counter wraps
+	}
+	state_set(STATE_WINDOW_WAIT);
+	histogram_mode = 0;
+	stream_begin();
+	TIM2_PSC = TIM3_PSC;
+	TIM2_EGR = TIM_EGR_UG;	// load the prescaler
+	TIM2_CCR1 = start;
+	TIM2_CCR2 = start + length;
+	state_time = next_time(10000);	// 1s timeout on finding the index
+	exti_set_trigger(EXTI_INDEX, EXTI_TRIGGER_FALLING);
+	exti_enable_request(EXTI_INDEX);
 }
 
 /*void event_poll()
@@ -308,15 +624,15 @@ void read(uint8_t count)
 			switch(events[next_event])
 			{
 				case EVENT_STEP_TICK:
-					gpio_clear(PORT_STEP, PIN_STEP);
+					PIN_LOW(STEP);
 					event_add(EVENT_STEP_TOCK, 60);
 					break;
 				case EVENT_STEP_TOCK:
-					//gpio_set(GPIOD, GPIO12);
-					gpio_set(PORT_STEP, PIN_STEP);
+					//LED_ON();
+					PIN_HIGH(STEP);
 					if(target_cylinder == 0)
 					{
-						if(gpio_get(PORT_TRACK0, PIN_TRACK0) == 0)
+						if(PIN_READ(TRACK0) == 0)
 						{
 							current_cylinder = 0;
 							event_add(EVENT_STEP_DONE, 200);
@@ -341,7 +657,7 @@ void read(uint8_t count)
 					}
 					break;
 				case EVENT_STEP_DONE:
-					gpio_set(PORT_DIR, PIN_DIR);
+					PIN_HIGH(DIR);
 					// send a done message to the host
 					//while(usbd_ep_write_packet(usb_device, 0x82, (const char*)MSG_DONE, 1) == 0);
 					break;
@@ -356,9 +672,97 @@ void read(uint8_t count)
 	}
 }*/
 
+void frame_crc_send(uint8_t message, uint16_t frame)
+{
+	uint32_t crc = frame_crcs[frame];
+	uint8_t buffer[7] = {message, frame, frame >> 8,
+		crc, crc >> 8, crc >> 16, crc >> 24};
+	
+	serial_send(buffer, 7);
+}
+
+/*	Copies the stream from position up to end, or 64 bytes of it, out of the
+	ring into a packet. The last word is padded with zeros, the crc is over
+	whole words. Returns the length. */
+uint32_t out_buffer_copy(uint32_t *packet, uint32_t position, uint32_t end)
+{
+	uint32_t length = end - position;
+	uint32_t byte;
+	
+	if(length > 64)
+	{
+		length = 64;
+	}
+	packet[(length - 1) >> 2] = 0;
+	for(byte = 0; byte < length; byte++)
+	{
+		((uint8_t *)packet)[byte] = out_buffer[(position + byte) & OUT_BUFFER_MASK];
+	}
+	return length;
+}
+
+// only once the whole stream is sent, so the resend is not mixed into it
+void resend_frame(uint16_t frame)
+{
+	uint32_t packet[16];
+	uint32_t start;
+	uint32_t position;
+	uint32_t length;
+	
+	if(stream_open || (frames_sent != frames_closed) || (frame >= frames_closed))
+	{
+		serial_send_byte(MSG_RESEND_FAILED);
+		return;
+	}
+	start = frame ? frame_ends[frame - 1] : 0;
+	if((out_position - start) > OUT_BUFFER_SIZE)
+	{
+		serial_send_byte(MSG_RESEND_FAILED);
+		return;
+	}
+	for(position = start; position < frame_ends[frame]; position += length)
+	{
+		length = out_buffer_copy(packet, position, frame_ends[frame]);
+		serial_send(packet, length);
+	}
+	frame_crc_send(MSG_FRAME_CRC, frame);
+}
+
+#if TRACE
+struct trace_header {
+	uint8_t message;	// MSG_TRACE
+	uint16_t count;		// number of events that follow, oldest first
+	uint32_t cycles_per_second;
+} __attribute__((packed));
+
+void trace_dump()
+{
+	struct trace_header header;
+	uint32_t first;
+	
+	trace_enabled = 0;
+	header.message = MSG_TRACE;
+	header.count = trace_position < TRACE_SIZE ? trace_position : TRACE_SIZE;
+	header.cycles_per_second = BOARD_AHB_HZ;
+	serial_send(&header, sizeof(header));
+	first = (trace_position - header.count) & (TRACE_SIZE - 1);
+	if(first + header.count > TRACE_SIZE)
+	{
+		serial_send(&trace_ring[first], (TRACE_SIZE - first) * sizeof(struct trace_event));
+		serial_send(trace_ring, (first + header.count - TRACE_SIZE) * sizeof(struct trace_event));
+	}
+	else
+	{
+		serial_send(&trace_ring[first], header.count * sizeof(struct trace_event));
+	}
+	trace_enabled = 1;
+}
+#endif
+
 void state_poll()
 {
 	uint32_t time = system_time;
+	uint8_t detected;
 	if(state != STATE_DONE)
 	{
 		if((time >= state_time) && ((time - state_time) < 1000))
@@ -366,18 +770,18 @@ void state_poll()
 			switch(state)
 			{
 				case STATE_STEP_TICK:
-					gpio_clear(PORT_STEP, PIN_STEP);
-					state = STATE_STEP_TOCK;
+					PIN_LOW(STEP);
+					state_set(STATE_STEP_TOCK);
 					state_time = next_time(60);
 					break;
 				case STATE_STEP_TOCK:
-					gpio_set(PORT_STEP, PIN_STEP);
+					PIN_HIGH(STEP);
 					if(target_cylinder == 0)
 					{
-						if(gpio_get(PORT_TRACK0, PIN_TRACK0) == 0)
+						if(PIN_READ(TRACK0) == 0)
 						{
 							current_cylinder = 0;
-							state = STATE_STEP_DONE;
+							state_set(STATE_STEP_DONE);
 							state_time = next_time(200);
 							break;
 						}
@@ -392,25 +796,59 @@ void state_poll()
 					}
 					if(current_cylinder == target_cylinder)
 					{
-						state = STATE_STEP_DONE;
+						state_set(STATE_STEP_DONE);
 						state_time = next_time(200);
 					}
 					else
 					{
-						state = STATE_STEP_TICK;
+						state_set(STATE_STEP_TICK);
 						state_time = next_time(60);
 					}
 					break;
 				case STATE_STEP_DONE:
-					gpio_set(PORT_DIR, PIN_DIR);
-					state = STATE_DONE;
+					PIN_HIGH(DIR);
+					state_set(STATE_DONE);
+					if(surveying)
+					{
+						histogram_capture(STATE_SURVEY);
+						break;
+					}
 					// Send a done message to the host
 					serial_send_byte(MSG_DONE);
 					break;
 				case STATE_SPINUP:
-					state = STATE_DONE;
+					state_set(STATE_DONE);
 					serial_send_byte(MSG_DONE);
 					break;
+				case STATE_DETECT:
+				case STATE_SURVEY:
+					// the index pulses never came
+					exti_disable_request(EXTI_INDEX);
+					exti_disable_request(EXTI_READDATA);
+					TIM3_CR1 &= ~1;	// disable timer
+					histogram_mode = 0;
+					surveying = 0;
+					density_set(saved_density);
+					state_set(STATE_DONE);
+					serial_send_byte(MSG_INDEX_TIMEOUT);
+					break;
+				case STATE_DETECT_DONE:
+					state_set(STATE_DONE);
+					detected = density_classify();
+					density_set(detected == DENSITY_UNKNOWN ? saved_density : detected);
+					serial_send_pair(MSG_DENSITY, detected);
+					break;
+				case STATE_WINDOW_WAIT:
+					// the index pulse never came
+					exti_disable_request(EXTI_INDEX);
+					state_set(STATE_DONE);
+					serial_send_byte(MSG_INDEX_TIMEOUT);
+					break;
+				case STATE_SURVEY_DONE:
+					state_set(STATE_DONE);
+					survey_send();
+					survey_next();
+					break;
 			}
 		}			
 	}
@@ -423,6 +861,7 @@ void data_rx_handler(usbd_device *device, uint8_t endpoint)
 	char buffer_in[64];
 	char buffer_out[64];
 	int length = usbd_ep_read_packet(device, 0x01, buffer_in, 64);
+	uint8_t character;
 	
 	if(length)
 	{
@@ -444,10 +883,60 @@ void data_rx_handler(usbd_device *device, uint8_t endpoint)
 				motor(buffer_in[1]);
 				break;
 			case CMD_READ:
-				read(1);
+				read(1, 0);
 				break;
 			case CMD_READ_MULTI:
-				read(buffer_in[1]);
+				read(buffer_in[1], 0);
+				break;
+			case CMD_READ_STOP:
+				// Takes effect at the next index pulse, the isr sends MSG_DONE
+				if(state == STATE_READ)
+				{
+					read_stop = 1;
+				}
+				break;
+			case CMD_READ_UNTIL:
+				// Same as read multi, but the host is expected to send a
+				// stop as soon as every sector has been read with a good crc.
+				// A stop is not honoured until one full revolution is read.
+				read(buffer_in[1], 1);
+				break;
+			case CMD_DETECT_DENSITY:
+				detect_density();
+				break;
+			case CMD_SURVEY:
+				survey(buffer_in[1]);
+				break;
+			case CMD_RESEND_FRAME:
+				if(length >= 3)
+				{
+					resend_frame((uint8_t)buffer_in[1] | ((uint8_t)buffer_in[2] << 8));
+				}
+				break;
+			case CMD_TRACE_DUMP:
+#if TRACE
+				trace_dump();
+#else
+				serial_send_byte(MSG_INVALID_CMD);
+#endif
+				break;
+			case CMD_READ_WINDOW:
+				if(length >= 7)
+				{
+					read_window((uint8_t)buffer_in[1] | ((uint8_t)buffer_in[2] << 8) |
+						((uint32_t)(uint8_t)buffer_in[3] << 16),
+						(uint8_t)buffer_in[4] | ((uint8_t)buffer_in[5] << 8) |
+						((uint32_t)(uint8_t)buffer_in[6] << 16));
+				}
+				break;
+			case CMD_SERIAL:
+				// the same string as the usb descriptor, for hosts that can not see it
+				buffer_out[0] = MSG_SERIAL;
+				for(character = 0; character < 24; character++)
+				{
+					buffer_out[character + 1] = usb_serial[character];
+				}
+				while(usbd_ep_write_packet(device, 0x82, buffer_out, 25) == 0);
 				break;
 			case CMD_HANDSHAKE:
 				buffer_out[0] = 'F';
@@ -510,57 +999,106 @@ void cdcacm_set_config(usbd_device *device, uint16_t wValue)
 void setup_timer()
 {
 	rcc_periph_clock_enable(RCC_TIM3);
-	TIM3_PSC |= 4;	// 21MHz at sysclk 168MHz
 	TIM3_DIER |= 1;
 	TIM3_ARR = 0xbf;	// If I have a timer that can count to 191 I need to start at 64(0x40)
 	TIM3_CR1 |= 16;	// set timer as countdown
+	TIM3_CR1 |= TIM_CR1_URS;	// only underflow interrupts, not a forced update
+	density_set(DENSITY_HD);
+	
+	// TIM2 times capture windows from the index pulse, read_window sets its
+	// prescaler to match the capture timer
+	rcc_periph_clock_enable(RCC_TIM2);
+	TIM2_ARR = 0xffffffff;
+	TIM2_SR = 0;
+	TIM2_DIER = TIM_DIER_CC1IE | TIM_DIER_CC2IE;
 }
 
-void TIM3_isr(void)	// Timer overflow handler
+void tim2_isr(void)	// Capture window handler
 {
-	message_add(MSG_OVERFLOW);
+	TRACE_EVENT(TRACE_TIM2_ENTER, 0);
+	if(TIM2_SR & TIM_SR_CC1IF)	// window start
+	{
+		TIM2_SR = ~TIM_SR_CC1IF;
+		TIM3_CNT = 0xbf;
+		TIM3_CR1 |= 1;	// enable timer
+		EXTI_CLEAR(EXTI_READDATA);
+		exti_enable_request(EXTI_READDATA);
+		message_add(MSG_WINDOW_START);
+	}
+	if(TIM2_SR & TIM_SR_CC2IF)	// window end
+	{
+		TIM2_SR = ~TIM_SR_CC2IF;
+		exti_disable_request(EXTI_READDATA);
+		TIM2_CR1 &= ~TIM_CR1_CEN;
+		capture_timer_stop();
+		message_add((uint8_t)TIM3_CNT);
+		state_set(STATE_DONE);
+		stream_end();
+	}
+	TRACE_EVENT(TRACE_TIM2_EXIT, 0);
 }
 
-void exti15_10_isr(void)	// Index handler
+void tim3_isr(void)	// Timer overflow handler
 {
-	exti_reset_request(EXTI15);
-	gpio_set(GPIOD, GPIO12);
+	TRACE_EDGE(TRACE_TIM3_ENTER);
+	TIM3_SR = ~TIM_SR_UIF;
+	if(histogram_mode)
+	{
+		histogram_overflow = 1;
+	}
+	else
+	{
+		message_add(MSG_OVERFLOW);
+	}
+	TRACE_EDGE(TRACE_TIM3_EXIT);
+}
+
+void index_isr(void)	// Index handler
+{
+	uint8_t count;
+	
+	TRACE_EVENT(TRACE_INDEX_ENTER, 0);
+	EXTI_CLEAR(EXTI_INDEX);
+	TRACE_EVENT(TRACE_INDEX_EDGE, PIN_READ(INDEX) != 0);
+	LED_ON();
 	if(state == STATE_READ)
 	{
 		if(index_state == 0)
 		{
-			TIM3_CR1 &= ~1;	// disable timer
-			message_add((uint8_t)TIM3_CNT);
-			message_add(MSG_INDEX_ON);
+			capture_timer_stop();
+			count = TIM3_CNT;
 			TIM3_CNT = 0xbf;
 			TIM3_CR1 |= 1;
+			message_add(count);
+			// each revolution is a frame of its own, starting at the index
+			if(frames_closed < FRAME_MAX - 1)
+			{
+				frame_end(MSG_FRAME_END);
+			}
+			message_add(MSG_INDEX_ON);
 			if(index_count == 0)
 			{
 				// TODO: change index interrupt trigger mode
-				exti_set_trigger(EXTI15, EXTI_TRIGGER_BOTH);
+				exti_set_trigger(EXTI_INDEX, EXTI_TRIGGER_BOTH);
 			}
 			index_state = 1;
 			index_count++;
 		}
 		else
 		{
-			TIM3_CR1 &= ~1;	// disable timer
+			capture_timer_stop();
 			message_add((uint8_t)TIM3_CNT);
 			message_add(MSG_INDEX_OFF);
 			TIM3_CNT = 0xbf;
 			// TODO: reset timer
-			if(index_count > read_target)
+			if((index_count > read_target) || (read_stop && (index_count > read_minimum)))
 			{
-				state = STATE_DONE;
+				state_set(STATE_DONE);
 				// TODO: disable timer
 				// TODO: disable index pin intterupt
-				exti_disable_request(EXTI15);
-				exti_disable_request(EXTI6);
-				message_add(MSG_DONE);
-				for(i=0;i<64;i++)
-				{
-					message_add(0x69);
-				}
+				exti_disable_request(EXTI_INDEX);
+				exti_disable_request(EXTI_READDATA);
+				stream_end();
 			}
 			else
 			{
@@ -569,65 +1107,152 @@ void exti15_10_isr(void)	// Index handler
 			index_state = 0;
 		}
 	}
+	else if(state == STATE_WINDOW_WAIT)
+	{
+		TIM2_CNT = 0;
+		TIM2_SR = 0;
+		TIM2_CR1 |= TIM_CR1_CEN;
+		exti_disable_request(EXTI_INDEX);
+		message_add(MSG_INDEX_ON);
+		state_set(STATE_WINDOW);
+	}
+	else if((state == STATE_DETECT) || (state == STATE_SURVEY))
+	{
+		if(index_count == 0)
+		{
+			// start sampling the revolution
+			histogram_start_cycles = DWT_CYCCNT;
+			TIM3_CNT = 0xbf;
+			TIM3_CR1 |= 1;	// enable timer
+			exti_enable_request(EXTI_READDATA);
+			index_count = 1;
+		}
+		else
+		{
+			histogram_period_cycles = DWT_CYCCNT - histogram_start_cycles;
+			exti_disable_request(EXTI_READDATA);
+			exti_disable_request(EXTI_INDEX);
+			TIM3_CR1 &= ~1;	// disable timer
+			histogram_mode = 0;
+			if(state == STATE_DETECT)
+			{
+				state_set(STATE_DETECT_DONE);
+			}
+			else
+			{
+				state_set(STATE_SURVEY_DONE);
+			}
+			state_time = system_time;
+		}
+	}
+	TRACE_EVENT(TRACE_INDEX_EXIT, 0);
 }
 
-void exti9_5_isr(void)	// Read data handler
+void readdata_isr(void)	// Read data handler
 {
-	exti_reset_request(EXTI6);
+	uint8_t count;
+	
+	TRACE_EDGE(TRACE_READDATA_ENTER);
+	EXTI_CLEAR(EXTI_READDATA);
 	TIM3_CR1 &= ~1;	// disble timer
-	message_add((uint8_t)TIM3_CNT);
+	count = TIM3_CNT;
 	TIM3_CNT = 0xbf;
 	TIM3_CR1 |= 1;	// enable timer
+	if(histogram_mode)
+	{
+		histogram_transitions++;
+		if(histogram_overflow)
+		{
+			histogram_overflow = 0;
+		}
+		else
+		{
+			histogram[(0xbf - count) >> HISTOGRAM_SHIFT]++;
+		}
+	}
+	else
+	{
+		message_add(count);
+	}
+	TRACE_EDGE(TRACE_READDATA_EXIT);
 }
 
+/*	Sends the stream in full packets, and the tail of each frame in a short
+	one followed by its crc. Frame ends can only be at or past out_position,
+	so a full packet never runs past one that is closed while it is sent. */
 void out_buffer_poll()
 {
-	if(out_count > 64)
+	uint32_t packet[16];
+	uint32_t end = out_position;
+	uint32_t length;
+	uint8_t frame_done = 0;
+	
+	if((frames_sent < frames_closed) && ((frame_ends[frames_sent] - out_sent) <= 64))
 	{
-		if(out_position < 64)
-		{
-			usbd_ep_write_packet(usb_device, 0x82, out_buffer, 64);
-		}
-		else
+		end = frame_ends[frames_sent];
+		frame_done = 1;
+	}
+	else if((end - out_sent) < 64)
+	{
+		return;
+	}
+	length = out_buffer_copy(packet, out_sent, end);
+	if((out_position - out_sent) > OUT_BUFFER_SIZE)
+	{
+		// the interrupts wrapped over it, maybe while it was copied
+		frame_overrun = 1;
+	}
+	if(frame_done && frame_overrun)
+	{
+		// its end was overwritten too, the host needs it to find the last frame
+		((uint8_t *)packet)[length - 1] =
+			(stream_open || (frames_sent + 1 < frames_closed)) ? MSG_FRAME_END : MSG_DONE;
+	}
+	if(usbd_ep_write_packet(usb_device, 0x82, packet, length))
+	{
+		// the crc runs here, not in the interrupts, on what was sent
+		frame_crc_add(packet, (length + 3) >> 2);
+		out_sent += length;
+		TRACE_EVENT(TRACE_USB_PACKET, out_sent >> 6);
+		if(frame_done)
 		{
-			usbd_ep_write_packet(usb_device, 0x82, out_buffer + 64, 64);
+			frame_crcs[frames_sent] = frame_crc_value();
+			frame_crc_send(frame_overrun ? MSG_FRAME_OVERRUN : MSG_FRAME_CRC, frames_sent);
+			frame_overrun = 0;
+			frames_sent++;
+			frame_crc_reset();
 		}
-		out_count -= 64;
 	}
 }
 
 void setup_io()
 {
 	// start the gpio clocks
-	rcc_periph_clock_enable(RCC_GPIOB);
-	rcc_periph_clock_enable(RCC_GPIOC);
-	rcc_periph_clock_enable(RCC_GPIOD);
-	rcc_periph_clock_enable(RCC_GPIOE);
-	rcc_periph_clock_enable(RCC_GPIOH);
+	board_gpio_clocks();
 	
 	// setup the outputs
-	gpio_clear(PORT_DENSEL, PIN_DENSEL);	// select HD as default
+	PIN_LOW(DENSEL);	// select HD as default
 	gpio_mode_setup(PORT_DENSEL, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, PIN_DENSEL);
 	gpio_set_output_options(PORT_DENSEL, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, PIN_DENSEL);
-	gpio_set(PORT_MOTOR1, PIN_MOTOR1);
+	PIN_HIGH(MOTOR1);
 	gpio_mode_setup(PORT_MOTOR1, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, PIN_MOTOR1);
 	gpio_set_output_options(PORT_MOTOR1, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, PIN_MOTOR1);
-	gpio_set(PORT_MOTOR2, PIN_MOTOR2);
+	PIN_HIGH(MOTOR2);
 	gpio_mode_setup(PORT_MOTOR2, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, PIN_MOTOR2);
 	gpio_set_output_options(PORT_MOTOR2, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, PIN_MOTOR2);
-	gpio_set(PORT_DRVSEL1, PIN_DRVSEL1);
+	PIN_HIGH(DRVSEL1);
 	gpio_mode_setup(PORT_DRVSEL1, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, PIN_DRVSEL1);
 	gpio_set_output_options(PORT_DRVSEL1, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, PIN_DRVSEL1);
-	gpio_set(PORT_DRVSEL2, PIN_DRVSEL2);
+	PIN_HIGH(DRVSEL2);
 	gpio_mode_setup(PORT_DRVSEL2, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, PIN_DRVSEL2);
 	gpio_set_output_options(PORT_DRVSEL2, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, PIN_DRVSEL2);
-	gpio_set(PORT_DIR, PIN_DIR);
+	PIN_HIGH(DIR);
 	gpio_mode_setup(PORT_DIR, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, PIN_DIR);
 	gpio_set_output_options(PORT_DIR, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, PIN_DIR);
-	gpio_set(PORT_STEP, PIN_STEP);
+	PIN_HIGH(STEP);
 	gpio_mode_setup(PORT_STEP, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, PIN_STEP);
 	gpio_set_output_options(PORT_STEP, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, PIN_STEP);
-	gpio_set(PORT_SIDESEL, PIN_SIDESEL);
+	PIN_HIGH(SIDESEL);
 	gpio_mode_setup(PORT_SIDESEL, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, PIN_SIDESEL);
 	gpio_set_output_options(PORT_SIDESEL, GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ, PIN_SIDESEL);
 	
@@ -641,19 +1266,21 @@ void setup_io()
 
 int main(void)
 {
-	rcc_clock_setup_pll(&rcc_hse_8mhz_3v3[RCC_CLOCK_3V3_168MHZ]);
+	rcc_clock_setup_pll(BOARD_CLOCK);
 	rcc_periph_clock_enable(RCC_GPIOA);
 	rcc_periph_clock_enable(RCC_OTGFS);
 	rcc_periph_clock_enable(RCC_SYSCFG);
+	rcc_periph_clock_enable(RCC_CRC);
 	gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO11 | GPIO12);
 	gpio_set_af(GPIOA, GPIO_AF10, GPIO11 | GPIO12);
 	
-	nvic_enable_irq(NVIC_EXTI15_10_IRQ);
-	exti_select_source(EXTI15, PORT_INDEX);
-	nvic_enable_irq(NVIC_EXTI9_5_IRQ);
-	exti_select_source(EXTI6, PORT_READDATA);
-	exti_set_trigger(EXTI6, EXTI_TRIGGER_FALLING);
+	nvic_enable_irq(NVIC_INDEX_IRQ);
+	exti_select_source(EXTI_INDEX, PORT_INDEX);
+	nvic_enable_irq(NVIC_READDATA_IRQ);
+	exti_select_source(EXTI_READDATA, PORT_READDATA);
+	exti_set_trigger(EXTI_READDATA, EXTI_TRIGGER_FALLING);
 	
+	desig_get_unique_id_as_string(usb_serial, sizeof(usb_serial));
 	usb_device = usbd_init(&otgfs_usb_driver, &device_desc, &configuration_desc,
 		usb_strings, 3, control_buffer, sizeof(control_buffer));
 		
@@ -662,14 +1289,16 @@ int main(void)
 	setup_io();
 	setup_timer();
 	nvic_enable_irq(NVIC_TIM3_IRQ);
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+	dwt_enable_cycle_counter();	// index period timing
 	
 	// setup systick
-	systick_set_reload(16800);	// 0.1mS interval
+	systick_set_reload(BOARD_AHB_HZ / 10000);	// 0.1mS interval
 	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
 	systick_counter_enable();
 	systick_interrupt_enable();
 
-	gpio_mode_setup(GPIOD, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO12);
+	gpio_mode_setup(PORT_LED, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, PIN_LED);
 	
 	//drive(1);
 	//motor(1);
@@ -680,18 +1309,18 @@ int main(void)
 	/*read(1);
 	while(1)
 	{}
-	if(gpio_get(PORT_TRACK0, PIN_TRACK0))
+	if(PIN_READ(TRACK0))
 	{
-		if(gpio_get(PORT_DISKCH, PIN_DISKCH))
+		if(PIN_READ(DISKCH))
 		{
-			gpio_set(GPIOD, GPIO12);
+			LED_ON();
 		}
 		cylinder(0);
 	}
 	else
 	{
 		current_cylinder = 0;
-		cylinder(79);
+		cylinder(LAST_CYLINDER);
 	}
 	
 	while(1)
@@ -704,5 +1333,6 @@ int main(void)
 		out_buffer_poll();
 		usbd_poll(usb_device);
 		state_poll();
+		disk_poll();
 	}
 }
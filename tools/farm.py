@@ -0,0 +1,360 @@
+#!/usr/bin/env python3
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Runs many boards side by side, imaging whatever disk is put in each.
+
+	farm.py --store images				# every /dev/ttyACM* that answers
+	farm.py /dev/ttyACM0 /dev/ttyACM3 --store images
+
+Boards are found by their handshake reply and known by their usb serial
+number. Each board has an asyncio reader of its own, so a slow or stuck
+board holds up nothing else. Streams are decoded and checked in a worker
+pool shared by all boards, and the imaging jobs go into a job store, see
+jobstore.py, so a new disk gets a new job and a known one is resumed.
+The throughput of each board is reported as it goes."""
+
+import argparse
+import asyncio
+import concurrent.futures
+import glob
+import os
+import sys
+import termios
+import time
+import tty
+
+import floppything as ft
+from jobstore import Fingerprint, JobStore
+
+TIMEOUT = 5.0
+PROBE_TIMEOUT = 1.0
+DISK_POLL = 1.0
+
+
+class Unit:
+	"""One board, with its own reader and writer on the event loop."""
+
+	def __init__(self, path, reader, transport, writer):
+		self.path = path
+		self.timeout = TIMEOUT
+		self.reader = reader
+		self.transport = transport
+		self.writer = writer
+		self.executor = None	# for the cpu work of commands, None is asyncio's default
+		self.buffer = bytearray()
+		self.serial = None
+		self.bytes = 0
+		self.tracks = 0
+		self.bad_tracks = 0
+		self.busy = 0.0			# seconds spent reading tracks
+		self.started = time.monotonic()
+		self.job = None
+
+	@classmethod
+	async def open(cls, path):
+		fd = os.open(path, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+		try:
+			tty.setraw(fd)
+			loop = asyncio.get_running_loop()
+			reader = asyncio.StreamReader(limit=1 << 20)
+			# a handle each for reading and writing, the transports own and close them
+			transport, _ = await loop.connect_read_pipe(
+				lambda: asyncio.StreamReaderProtocol(reader), open(os.dup(fd), "rb", buffering=0))
+			try:
+				writer, _ = await loop.connect_write_pipe(
+					asyncio.Protocol, open(os.dup(fd), "wb", buffering=0))
+			except BaseException:
+				transport.close()
+				raise
+		except termios.error as error:
+			raise OSError(*error.args)
+		finally:
+			os.close(fd)
+		return cls(path, reader, transport, writer)
+
+	def close(self):
+		self.writer.close()
+		self.transport.close()
+
+	def write(self, data):
+		# buffered by the transport, which writes as the board takes it
+		self.writer.write(bytes(data))
+
+	async def fill(self, timeout=None):
+		chunk = await asyncio.wait_for(self.reader.read(65536),
+			self.timeout if timeout is None else timeout)
+		if not chunk:
+			raise EOFError("%s: closed" % self.path)
+		self.buffer += chunk
+		self.bytes += len(chunk)
+
+	async def read(self, length, timeout=None):
+		while len(self.buffer) < length:
+			await self.fill(timeout)
+		data = bytes(self.buffer[:length])
+		del self.buffer[:length]
+		return data
+
+	async def read_until(self, markers, timeout=None):
+		searched = 0
+		while True:
+			position = ft.find_marker(self.buffer, markers, searched)
+			if position >= 0:
+				return await self.read(position + 1)
+			searched = len(self.buffer)
+			await self.fill(timeout)
+
+	@property
+	def name(self):
+		return self.serial or self.path
+
+	async def run(self, steps):
+		"""Runs a command of ft.Protocol, as ft.Device does on a blocking link."""
+		result = None
+		while True:
+			try:
+				step = steps.send(result)
+			except StopIteration as stop:
+				return stop.value
+			if isinstance(step, ft.Write):
+				self.write(step.data)
+				result = None
+			elif isinstance(step, ft.ReadUntil):
+				result = await self.read_until(step.markers, step.timeout)
+			elif isinstance(step, ft.Compute):
+				result = await asyncio.get_running_loop().run_in_executor(self.executor,
+					step.function, *step.args)
+			else:
+				result = await self.read(step.length, step.timeout)
+
+	def __getattr__(self, name):
+		if name.startswith("_"):
+			raise AttributeError(name)
+		command = getattr(ft.PROTOCOL, name)
+		return lambda *args: self.run(command(*args))
+
+	def throughput(self):
+		elapsed = max(time.monotonic() - self.started, 1e-6)
+		return {"unit": self.name, "path": self.path, "tracks": self.tracks,
+			"bad tracks": self.bad_tracks, "bytes": self.bytes,
+			"bytes/s": self.bytes / elapsed, "tracks/min": self.tracks * 60 / elapsed,
+			"busy": self.busy, "job": self.job.path if self.job else None}
+
+
+async def probe(path):
+	"""Opens path and returns a Unit if a board answers there, else None."""
+	try:
+		unit = await Unit.open(path)
+	except OSError:
+		return None
+	try:
+		unit.timeout = PROBE_TIMEOUT
+		if not await unit.handshake():
+			raise ft.ProtocolError("not a board")
+		unit.timeout = TIMEOUT
+		unit.serial = ft.usb_serial(path) or await unit.run(ft.PROTOCOL.serial())
+		unit.bytes = 0
+	except (asyncio.TimeoutError, EOFError, ft.ProtocolError, OSError):
+		unit.close()
+		return None
+	return unit
+
+
+async def discover(paths):
+	"""Probes all paths at once. A board seen on two paths, such as a link in
+	/dev/serial/by-id and its target, is used once."""
+	units = []
+	serials = set()
+	paths = list(dict.fromkeys(os.path.realpath(path) for path in paths))
+	for unit in await asyncio.gather(*(probe(path) for path in paths)):
+		if unit is None:
+			continue
+		if unit.serial in serials:
+			unit.close()
+			continue
+		serials.add(unit.serial)
+		units.append(unit)
+	return units
+
+
+def decode_track(frames):
+	"""Runs in the decode pool. Returns the number of revolutions in a stream
+	and their mean length in timer ticks, a track is only kept if it has at
+	least one. There are fewer than asked for when all sectors read good
+	early."""
+	_, decoded = ft.decode_stream(frames)
+	lengths = [sum(revolution) for revolution in decoded]
+	return len(decoded), sum(lengths) // max(1, len(lengths))
+
+
+class Farm:
+	def __init__(self, units, store, pool, drive=1, cylinders=80, heads=2,
+			revolutions=5, retries=3, log=print):
+		self.units = units
+		for unit in units:
+			unit.executor = pool
+		self.store = store
+		self.pool = pool
+		self.drive = drive
+		self.settings = {"cylinders": cylinders, "heads": heads, "revolutions": revolutions}
+		self.retries = retries
+		self.log = log
+		self.store_lock = asyncio.Lock()
+
+	async def read_track(self, unit, revolutions):
+		"""Reads the current track, returns its stream, the bad frames and
+		the number of revolutions and their mean length."""
+		loop = asyncio.get_running_loop()
+		decoded = period = 0
+		for _ in range(self.retries):
+			frames, bad = await unit.read_until_good(revolutions, self.retries)
+			if bad:
+				continue
+			decoded, period = await loop.run_in_executor(self.pool, decode_track, frames)
+			if decoded:
+				break
+			bad = [len(frames) - 1]		# cut short, call the last frame bad
+		return b"".join(frame.data for frame in frames), bad, decoded, period
+
+	async def image(self, unit):
+		"""Images the disk in a unit, returns False if it was taken out."""
+		loop = asyncio.get_running_loop()
+		# the read of track 0 head 0 finds the job, and is kept if it needs it
+		started = time.monotonic()
+		await unit.seek(0)
+		await unit.head(0)
+		first = await self.read_track(unit, self.settings["revolutions"])
+		unit.busy += time.monotonic() - started
+		fingerprint = await loop.run_in_executor(self.pool, Fingerprint.from_track, first[0])
+		async with self.store_lock:
+			job = unit.job = await asyncio.to_thread(self.store.open, fingerprint, self.settings)
+		missing = job.missing()
+		self.log("%s: %s, %d tracks to read" % (unit.name, job.path, len(missing)))
+		for cylinder, head in missing:
+			if await unit.check_disk() != ft.MSG_DISK_LOADED:
+				self.log("%s: disk changed" % unit.name)
+				return False
+			if (cylinder, head) == (0, 0):
+				data, bad, decoded, period = first
+			else:
+				started = time.monotonic()
+				await unit.seek(cylinder)
+				await unit.head(head)
+				data, bad, decoded, period = await self.read_track(unit, job.settings["revolutions"])
+				unit.busy += time.monotonic() - started
+			await asyncio.to_thread(job.write_track, cylinder, head, data, bad,
+				revolutions=decoded, period=period)
+			unit.tracks += 1
+			if bad:
+				unit.bad_tracks += 1
+		if not job.missing():
+			await asyncio.to_thread(job.finish)
+		self.log("%s: %s %s" % (unit.name, job.path, "done" if job.done else "has bad tracks"))
+		return True
+
+	async def serve(self, unit, once=False):
+		"""Images disks in a unit as they are put in. With once it images the
+		disk that is in and returns."""
+		await unit.select_drive(self.drive)
+		await unit.motor(True)
+		try:
+			while True:
+				if await unit.step_and_check_disk() == ft.MSG_NO_DISK:
+					if once:
+						return
+					await asyncio.sleep(DISK_POLL)
+					continue
+				if not await self.image(unit):
+					continue	# another disk went in while imaging, image that
+				if once:
+					return
+				# wait for the next disk
+				while await unit.check_disk() == ft.MSG_DISK_LOADED:
+					await asyncio.sleep(DISK_POLL)
+		finally:
+			await unit.motor(False)
+
+	async def report(self, interval):
+		while True:
+			await asyncio.sleep(interval)
+			for line in self.throughput_lines():
+				self.log(line)
+
+	def throughput_lines(self):
+		lines = []
+		for unit in self.units:
+			stats = unit.throughput()
+			lines.append("%-24s %5d tracks %3d bad %8.1f kB/s %6.1f tracks/min" % (stats["unit"],
+				stats["tracks"], stats["bad tracks"], stats["bytes/s"] / 1000, stats["tracks/min"]))
+		return lines
+
+	async def run(self, once=False, report=None):
+		"""Serves every unit until cancelled, or with once until each has
+		imaged its disk. A unit that fails is logged and dropped, the others
+		carry on. Returns the throughput of each unit."""
+		reporter = asyncio.ensure_future(self.report(report)) if report else None
+		results = await asyncio.gather(*(self.serve(unit, once) for unit in self.units),
+			return_exceptions=True)
+		if reporter:
+			reporter.cancel()
+		for unit, result in zip(self.units, results):
+			if isinstance(result, BaseException):
+				self.log("%s: failed, %s" % (unit.name, result))
+		return [unit.throughput() for unit in self.units]
+
+
+async def main_async(args):
+	paths = args.ports or sorted(glob.glob("/dev/ttyACM*"))
+	units = await discover(paths)
+	if not units:
+		sys.exit("no boards found")
+	for unit in units:
+		print("%s: %s" % (unit.path, unit.serial))
+	with concurrent.futures.ProcessPoolExecutor(args.workers) as pool:
+		farm = Farm(units, JobStore(args.store), pool, args.drive, args.cylinders,
+			args.heads, args.revolutions)
+		try:
+			await farm.run(args.once, args.report)
+		finally:
+			for line in farm.throughput_lines():
+				print(line)
+			for unit in units:
+				unit.close()
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+	parser.add_argument("ports", nargs="*", help="serial devices, default /dev/ttyACM*")
+	parser.add_argument("--store", default="images", help="job store directory")
+	parser.add_argument("--drive", type=int, default=1)
+	parser.add_argument("--cylinders", type=int, default=80)
+	parser.add_argument("--heads", type=int, default=2)
+	parser.add_argument("--revolutions", type=int, default=5,
+		help="most revolutions to read of a track, fewer once all sectors read good")
+	parser.add_argument("--workers", type=int, default=None, help="decode processes")
+	parser.add_argument("--report", type=float, default=10.0,
+		help="seconds between throughput reports")
+	parser.add_argument("--once", action="store_true",
+		help="image the disks that are in and stop")
+	try:
+		asyncio.run(main_async(parser.parse_args()))
+	except KeyboardInterrupt:
+		pass
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,521 @@
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Host side of the floppyThing protocol: the serial link, the read stream
+framing, frame crc checks with resends, and turning streams back into flux
+intervals. The constants mirror main.c."""
+
+import os
+import select
+import struct
+
+import mfm
+
+#	pc to mcu protocol
+CMD_HALT = 0x00
+CMD_SELECT_DRIVE = 0x01
+CMD_CYLINDER = 0x02
+CMD_HEAD = 0x03
+CMD_CHECK_DISK = 0x04
+CMD_MOTOR = 0x05
+CMD_READ = 0x06
+CMD_READ_MULTI = 0x07
+CMD_READ_STOP = 0x08
+CMD_READ_UNTIL = 0x09
+CMD_DETECT_DENSITY = 0x0A
+CMD_SURVEY = 0x0B
+CMD_RESEND_FRAME = 0x0C
+CMD_READ_WINDOW = 0x0D
+CMD_TRACE_DUMP = 0x0E
+CMD_SERIAL = 0x0F
+CMD_HANDSHAKE = 0x69
+
+#	mcu to pc protocol
+MSG_INVALID_CMD = 0xC0
+MSG_DONE = 0xC1
+MSG_OVERFLOW = 0xC2
+MSG_INDEX_ON = 0xC3
+MSG_INDEX_OFF = 0xC4
+MSG_NO_DISK = 0xC5
+MSG_DISK_LOADED = 0xC6
+MSG_DISK_EJECTED = 0xC7
+MSG_INDEX_TIMEOUT = 0xC8
+MSG_STREAM_HEADER = 0xC9
+MSG_DENSITY = 0xCA
+MSG_SURVEY = 0xCB
+MSG_FRAME_CRC = 0xCC
+MSG_RESEND_FAILED = 0xCD
+MSG_WINDOW_START = 0xCE
+MSG_TRACE = 0xCF
+MSG_FRAME_END = 0xD0
+MSG_SERIAL = 0xD1
+MSG_FRAME_OVERRUN = 0xD2
+
+#	densities, and the timer ticks in an mfm bit cell at each
+DENSITY_DD = 0x00
+DENSITY_HD = 0x01
+DENSITY_ED = 0x02
+CELL_TICKS = {DENSITY_DD: 16.8, DENSITY_HD: 16.8, DENSITY_ED: 21.0}
+
+HANDSHAKE_REPLY = b"FLOPPYTHING"
+LAST_CYLINDER = 79		# highest the firmware surveys
+SERIAL_LENGTH = 24
+PACKET = 64
+TIMER_TOP = 0xbf		# the capture timer counts down from here
+TIMER_PERIOD = 0xc0		# ticks between overflows
+
+FRAME_CRC = struct.Struct("<BHI")
+SURVEY_REPORT = struct.Struct("<BBBII48H")
+
+
+class ProtocolError(Exception):
+	pass
+
+
+def usb_serial(path):
+	"""The usb serial number of a cdc device from sysfs, None where there is
+	no such thing, as on other systems or for a pseudo terminal."""
+	name = os.path.basename(os.path.realpath(path))
+	interface = os.path.realpath("/sys/class/tty/%s/device" % name)
+	try:
+		with open(os.path.join(os.path.dirname(interface), "serial")) as file:
+			return file.read().strip()
+	except OSError:
+		return None
+
+
+def stream_crc(data):
+	"""Crc32 as the STM32 crc unit computes it over the stream: words loaded
+	little endian, polynomial 0x04C11DB7, initial value 0xFFFFFFFF, no bit
+	reflection and no final xor. Same as the fallback in crc.h. The tail of
+	a frame is padded with zeros to a whole word, as the firmware does."""
+	crc = 0xFFFFFFFF
+	data = bytes(data) + bytes(-len(data) % 4)
+	for (word,) in struct.iter_unpack("<I", data):
+		crc ^= word
+		for _ in range(32):
+			if crc & 0x80000000:
+				crc = ((crc << 1) ^ 0x04C11DB7) & 0xFFFFFFFF
+			else:
+				crc = (crc << 1) & 0xFFFFFFFF
+	return crc
+
+
+class Frame:
+	"""One frame of a read stream, the bytes as received and the crc the
+	device sent for them. An overrun frame was overwritten in the out buffer
+	before it was sent, only its last byte can be trusted."""
+
+	def __init__(self, number, data, crc, overrun=False):
+		self.number = number
+		self.data = data
+		self.crc = crc
+		self.overrun = overrun
+
+	@classmethod
+	def from_trailer(cls, data, trailer):
+		"""From the bytes up to and including the trailer message, and the
+		rest of that message."""
+		number, crc = struct.unpack("<HI", trailer)
+		return cls(number, data[:-1], crc, data[-1] == MSG_FRAME_OVERRUN)
+
+	@property
+	def good(self):
+		return not self.overrun and stream_crc(self.data) == self.crc
+
+	@property
+	def last(self):
+		return self.data[-1:] == bytes([MSG_DONE])
+
+
+def find_marker(data, markers, start=0):
+	"""Position of the first byte in data that is one of markers, or -1."""
+	found = [position for position in (data.find(marker, start) for marker in markers)
+		if position >= 0]
+	return min(found) if found else -1
+
+
+class Link:
+	"""Blocking link to a board, or anything else that looks like its cdc
+	serial port, such as a simulated device on a pseudo terminal."""
+
+	def __init__(self, path, timeout=5.0):
+		import termios
+		import tty
+
+		self.path = path
+		self.timeout = timeout
+		self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+		tty.setraw(self.fd)
+		termios.tcflush(self.fd, termios.TCIOFLUSH)
+		self.buffer = bytearray()
+
+	def close(self):
+		os.close(self.fd)
+
+	def __enter__(self):
+		return self
+
+	def __exit__(self, *exception):
+		self.close()
+
+	def write(self, data):
+		os.write(self.fd, bytes(data))
+
+	def fill(self, timeout=None):
+		ready, _, _ = select.select([self.fd], [], [],
+			self.timeout if timeout is None else timeout)
+		if not ready:
+			raise TimeoutError("%s: no reply" % self.path)
+		chunk = os.read(self.fd, 65536)
+		if not chunk:
+			raise EOFError("%s: closed" % self.path)
+		self.buffer += chunk
+
+	def read(self, length, timeout=None):
+		while len(self.buffer) < length:
+			self.fill(timeout)
+		data = bytes(self.buffer[:length])
+		del self.buffer[:length]
+		return data
+
+	def read_until(self, markers, timeout=None):
+		"""Reads up to and including the first byte that is one of markers."""
+		searched = 0
+		while True:
+			position = find_marker(self.buffer, markers, searched)
+			if position >= 0:
+				return self.read(position + 1)
+			searched = len(self.buffer)
+			self.fill(timeout)
+
+
+class Recording:
+	"""Reads like a Link from bytes recorded off one."""
+
+	def __init__(self, data):
+		self.data = bytes(data)
+		self.position = 0
+
+	def write(self, data):
+		pass	# the recording has the replies already
+
+	def read(self, length, timeout=None):
+		if self.position + length > len(self.data):
+			raise EOFError("recording ends")
+		self.position += length
+		return self.data[self.position - length:self.position]
+
+	def read_until(self, markers, timeout=None):
+		position = find_marker(self.data, markers, self.position)
+		if position < 0:
+			raise EOFError("recording ends")
+		return self.read(position + 1 - self.position)
+
+
+#	the firmware sends every count below 0xc0 and these only after a frame,
+#	so the first one found ends the frame
+FRAME_TRAILERS = frozenset([MSG_FRAME_CRC, MSG_FRAME_OVERRUN])
+
+
+class Write:
+	"""Step of a protocol command: send data."""
+
+	def __init__(self, data):
+		self.data = bytes(data)
+
+
+class Read:
+	"""Step of a protocol command: read length bytes. A timeout of None is
+	the link's own."""
+
+	def __init__(self, length, timeout=None):
+		self.length = length
+		self.timeout = timeout
+
+
+class ReadUntil:
+	"""Step of a protocol command: read up to and including the first byte
+	that is one of markers."""
+
+	def __init__(self, markers, timeout=None):
+		self.markers = markers
+		self.timeout = timeout
+
+
+class Compute:
+	"""Step of a protocol command: work for the cpu, the result of function
+	called with args. Kept out of the way of the io where that matters."""
+
+	def __init__(self, function, *args):
+		self.function = function
+		self.args = args
+
+
+class Protocol:
+	"""The commands of the protocol, apart from any io. Each is a generator
+	that yields Write, Read, ReadUntil and Compute steps and is sent what
+	they return. Device runs them on a blocking link, farm.Unit on asyncio."""
+
+	def expect(self, *messages):
+		reply = (yield Read(1))[0]
+		if reply not in messages:
+			raise ProtocolError("unexpected reply 0x%02x" % reply)
+		return reply
+
+	def command(self, data, *messages):
+		yield Write(data)
+		if messages:
+			return (yield from self.expect(*messages))
+
+	def handshake(self):
+		yield Write([CMD_HANDSHAKE])
+		return (yield Read(len(HANDSHAKE_REPLY))) == HANDSHAKE_REPLY
+
+	def serial(self):
+		yield from self.command([CMD_SERIAL], MSG_SERIAL)
+		return (yield Read(SERIAL_LENGTH)).decode("ascii")
+
+	def select_drive(self, drive):
+		yield from self.command([CMD_SELECT_DRIVE, drive], MSG_DONE)
+
+	def motor(self, on):
+		if on:
+			yield from self.command([CMD_MOTOR, 1], MSG_DONE)
+		else:
+			yield Write([CMD_MOTOR, 0])
+
+	def seek(self, cylinder):
+		yield from self.command([CMD_CYLINDER, cylinder], MSG_DONE)
+
+	def head(self, head):
+		yield from self.command([CMD_HEAD, head], MSG_DONE)
+
+	def check_disk(self):
+		return (yield from self.command([CMD_CHECK_DISK],
+			MSG_NO_DISK, MSG_DISK_LOADED, MSG_DISK_EJECTED))
+
+	def step_and_check_disk(self):
+		"""check_disk after stepping the head. A drive keeps its disk change
+		line active until it steps with a disk in, so without a step a disk
+		put in is never seen."""
+		yield from self.seek(1)
+		yield from self.seek(0)
+		return (yield from self.check_disk())
+
+	def survey(self, last_cylinder):
+		"""Returns {(cylinder, head): (index period in us, transitions, histogram)}."""
+		yield Write([CMD_SURVEY, last_cylinder])
+		reports = {}
+		while True:
+			first = yield Read(1)
+			if first[0] == MSG_DONE:
+				return reports
+			if first[0] != MSG_SURVEY:
+				raise ProtocolError("survey failed with 0x%02x" % first[0])
+			fields = SURVEY_REPORT.unpack(first + (yield Read(SURVEY_REPORT.size - 1)))
+			reports[(fields[1], fields[2])] = (fields[3], fields[4], fields[5:])
+
+	def read_frame(self, first=b""):
+		"""Reads one frame and the crc message after it."""
+		data = first + (yield ReadUntil(FRAME_TRAILERS))
+		return Frame.from_trailer(data, (yield Read(FRAME_CRC.size - 1)))
+
+	def read_stream(self):
+		"""Reads frames until the last one of the stream."""
+		frames = []
+		while not frames or not frames[-1].last:
+			frame = yield from self.read_frame()
+			if frame.number != len(frames):
+				raise ProtocolError("expected frame %d, got %d" % (len(frames), frame.number))
+			frames.append(frame)
+		return frames
+
+	def resend(self, number):
+		"""Asks for a frame again, returns it or None if the device no longer
+		has it."""
+		yield Write(struct.pack("<BH", CMD_RESEND_FRAME, number))
+		first = yield Read(1)
+		if first[0] == MSG_RESEND_FAILED:
+			return None
+		frame = yield from self.read_frame(first)
+		if frame.number != number:
+			raise ProtocolError("asked for frame %d, got %d" % (number, frame.number))
+		return frame
+
+	def verify_stream(self, frames, retries=3):
+		"""Checks the crc of every frame, and has the bad ones sent again.
+		Returns the numbers of the frames that are still bad, those need a
+		new read from the disk."""
+		bad = []
+		for index, frame in enumerate(frames):
+			attempt = 0
+			# an overrun frame is gone from the out buffer, no use asking again
+			while not frame.good and not frame.overrun and attempt < retries:
+				attempt += 1
+				again = yield from self.resend(frame.number)
+				if again is None:
+					break
+				frame = again
+			frames[index] = frame
+			if not frame.good:
+				bad.append(frame.number)
+		return bad
+
+	def read_track(self, revolutions, retries=3):
+		"""Reads the current track. Returns the frames, with bad ones resent
+		where possible, and the numbers of frames that are still bad."""
+		yield Write([CMD_READ_MULTI, revolutions])
+		frames = yield from self.read_stream()
+		return frames, (yield from self.verify_stream(frames, retries))
+
+	def read_window(self, start, length, retries=3):
+		"""Reads from start to start + length, in timer ticks after the next
+		index pulse, see decode_window. Returns the frames and the bad ones
+		as read_track does, no frames if the index pulse never came."""
+		yield Write(struct.pack("<B", CMD_READ_WINDOW) + start.to_bytes(3, "little") +
+			length.to_bytes(3, "little"))
+		first = yield Read(1)
+		if first[0] == MSG_INDEX_TIMEOUT:
+			return [], []
+		# the window is a single frame
+		frame = yield from self.read_frame(first)
+		if frame.number != 0 or not frame.last:
+			raise ProtocolError("window read in more than one frame")
+		frames = [frame]
+		return frames, (yield from self.verify_stream(frames, retries))
+
+	def read_until_good(self, revolutions, retries=3):
+		"""Like read_track, but revolutions is only the most to read. Each
+		revolution is decoded as it comes in, and once every sector seen
+		has read with a good crc the device is told to stop at the next
+		index pulse."""
+		yield Write([CMD_READ_UNTIL, revolutions])
+		frames = []
+		sectors = {}
+		stopping = False
+		while not frames or not frames[-1].last:
+			frame = yield from self.read_frame()
+			if frame.number != len(frames):
+				raise ProtocolError("expected frame %d, got %d" % (len(frames), frame.number))
+			frames.append(frame)
+			if stopping or frame.number == 0 or frame.last or not frame.good:
+				continue
+			sectors = yield Compute(revolution_sectors, sectors, frame, frames[0].data[1])
+			if mfm.all_good(sectors):
+				yield Write([CMD_READ_STOP])
+				stopping = True
+		return frames, (yield from self.verify_stream(frames, retries))
+
+
+PROTOCOL = Protocol()
+
+
+#	the firmware stops the capture timer at these and restarts it after, the
+#	count right before one is only part of an interval
+PARTIAL_ENDS = frozenset([MSG_INDEX_ON, MSG_INDEX_OFF, MSG_FRAME_END, MSG_DONE])
+
+
+def decode_intervals(data):
+	"""Turns stream bytes into flux intervals, in timer ticks, split at the
+	index pulses: what comes before the first, then what follows each. The
+	interval the index pulse falls in starts the part after the pulse."""
+	parts = []
+	current = []
+	overflows = 0
+	carry = 0		# the parts of an interval cut by index edges
+	position = 0
+	while position < len(data):
+		byte = data[position]
+		position += 1
+		if byte < TIMER_PERIOD:
+			interval = overflows * TIMER_PERIOD + TIMER_TOP - byte
+			overflows = 0
+			if position < len(data) and data[position] in PARTIAL_ENDS:
+				carry += interval
+			else:
+				current.append(carry + interval)
+				carry = 0
+		elif byte == MSG_OVERFLOW:
+			overflows += 1
+		elif byte == MSG_STREAM_HEADER:
+			position += 1	# density
+		elif byte == MSG_INDEX_ON:
+			parts.append(current)
+			current = []
+		elif byte == MSG_WINDOW_START:
+			# the capture timer starts here, nothing before is flux
+			current = []
+			carry = 0
+	parts.append(current)
+	return parts
+
+
+def decode_stream(frames):
+	"""Turns the frames of a read stream into flux intervals, in timer ticks.
+	Returns the lead in before the first index pulse and a list with the
+	intervals of each revolution, from index pulse to index pulse."""
+	parts = decode_intervals(b"".join(frame.data for frame in frames))
+	# what follows the last index pulse is the pulse itself, not a revolution
+	return parts[0], parts[1:-1]
+
+
+def decode_window(frames):
+	"""Turns the frames of a window read into flux intervals, in timer
+	ticks. The first is from the start of the window to the first flux
+	transition in it. Empty if the window never started."""
+	data = b"".join(frame.data for frame in frames)
+	if MSG_WINDOW_START not in data:
+		return []
+	return decode_intervals(data)[-1]
+
+
+def revolution_sectors(sectors, frame, density):
+	"""Adds the sectors in the revolution of a frame to those read before,
+	see mfm.merge_sectors."""
+	revolution = decode_intervals(frame.data)[-1]
+	cell = CELL_TICKS.get(density, CELL_TICKS[DENSITY_HD])
+	return mfm.merge_sectors(sectors, mfm.decode_sectors(revolution, cell))
+
+
+class Device:
+	"""The commands of Protocol on a blocking link, device.seek(3) and so on."""
+
+	def __init__(self, link):
+		self.link = link
+
+	def run(self, steps):
+		result = None
+		while True:
+			try:
+				step = steps.send(result)
+			except StopIteration as stop:
+				return stop.value
+			if isinstance(step, Write):
+				self.link.write(step.data)
+				result = None
+			elif isinstance(step, ReadUntil):
+				result = self.link.read_until(step.markers, step.timeout)
+			elif isinstance(step, Compute):
+				result = step.function(*step.args)
+			else:
+				result = self.link.read(step.length, step.timeout)
+
+	def __getattr__(self, name):
+		if name.startswith("_"):
+			raise AttributeError(name)
+		command = getattr(PROTOCOL, name)
+		return lambda *args: self.run(command(*args))
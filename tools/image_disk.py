@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Images a disk into a job store, resuming where an earlier run on the
+same disk stopped. Only tracks that are missing or were read with bad
+frames are read again.
+
+	image_disk.py /dev/ttyACM0 --store images
+
+If the disk is taken out the run stops, and carries on with whichever job
+matches the disk that goes in next."""
+
+import argparse
+import sys
+import time
+
+import floppything as ft
+from jobstore import Fingerprint, JobStore
+
+
+class DiskChanged(Exception):
+	pass
+
+
+def wait_for_disk(device, interval=1.0):
+	while device.step_and_check_disk() == ft.MSG_NO_DISK:
+		time.sleep(interval)
+
+
+def read_track(device, revolutions, retries):
+	for _ in range(retries):
+		frames, bad = device.read_until_good(revolutions)
+		if not bad:
+			break
+	return b"".join(frame.data for frame in frames), bad
+
+
+def image(device, store, cylinders=80, heads=2, revolutions=5, retries=3, log=None):
+	"""Images the disk in the drive, returns its job. Each track is read for
+	at most revolutions, and stops early once all its sectors read good.
+	Raises DiskChanged if the disk is taken out on the way."""
+	if device.check_disk() == ft.MSG_NO_DISK:
+		raise DiskChanged("no disk")
+	# any eject latched before this is answered by the fingerprint, the read
+	# of track 0 head 0 is kept if the job still needs it
+	device.seek(0)
+	device.head(0)
+	first = read_track(device, revolutions, retries)
+	job = store.open(Fingerprint.from_track(first[0]), {"cylinders": cylinders,
+		"heads": heads, "revolutions": revolutions})
+	missing = job.missing()
+	if log:
+		log("%s: %d tracks to read" % (job.path, len(missing)))
+	for cylinder, head in missing:
+		if device.check_disk() != ft.MSG_DISK_LOADED:
+			raise DiskChanged("disk changed before c%d h%d" % (cylinder, head))
+		if (cylinder, head) == (0, 0):
+			data, bad = first
+		else:
+			device.seek(cylinder)
+			device.head(head)
+			data, bad = read_track(device, job.settings["revolutions"], retries)
+		job.write_track(cylinder, head, data, bad)
+		if log:
+			log("c%02d h%d %s" % (cylinder, head, "bad frames %s" % bad if bad else "ok"))
+	if not job.missing():
+		job.finish()
+	return job
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+	parser.add_argument("port", help="serial device of the board")
+	parser.add_argument("--store", default="images", help="job store directory")
+	parser.add_argument("--drive", type=int, default=1)
+	parser.add_argument("--cylinders", type=int, default=80)
+	parser.add_argument("--heads", type=int, default=2)
+	parser.add_argument("--revolutions", type=int, default=5,
+		help="most revolutions to read of a track, fewer once all sectors read good")
+	args = parser.parse_args()
+
+	store = JobStore(args.store)
+	with ft.Link(args.port) as link:
+		device = ft.Device(link)
+		if not device.handshake():
+			sys.exit("%s: not a floppyThing" % args.port)
+		device.select_drive(args.drive)
+		device.motor(True)
+		try:
+			while True:
+				try:
+					job = image(device, store, args.cylinders, args.heads,
+						args.revolutions, log=print)
+					break
+				except DiskChanged as error:
+					print("%s, waiting for a disk" % error)
+					wait_for_disk(device)
+		finally:
+			device.motor(False)
+	print("%s: %s" % (job.path, "done" if job.done else
+		"%d tracks with bad frames" % len(job.missing())))
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,279 @@
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Imaging jobs that survive crashes, lost connections and disk swaps.
+
+A job is a directory holding the raw stream of each track read so far and
+an append only log, one json record per line. Every record and every track
+file is on disk before the next step starts, so a job can be picked up
+after anything, and only the tracks that are missing or bad are read again.
+A torn last line, from a crash in the middle of a write, is dropped.
+
+Jobs are found by a fingerprint of the disk, from a read of track 0 head
+0: the index period, and a hash of the sectors on it. Where the sectors do
+not all read, the flux of the read is compared with the stored track 0
+head 0 of each job instead."""
+
+import hashlib
+import json
+import os
+import tempfile
+
+import floppything as ft
+import mfm
+
+LOG = "log.jsonl"
+
+PERIOD_TOLERANCE = 0.02			# of the index period
+FLUX_CHUNK = 64					# cell runs in a stretch of flux that is looked for
+FLUX_MATCH = 0.8				# of the stretches found for two reads to be of one disk
+
+
+def cell_runs(data):
+	"""The cells between flux transitions of the first revolution of a
+	stream, one byte each, and the density of the stream."""
+	_, revolutions = ft.decode_stream([ft.Frame(0, data, 0)])
+	density = data[1] if data[:1] == bytes([ft.MSG_STREAM_HEADER]) else ft.DENSITY_HD
+	cell = ft.CELL_TICKS.get(density, ft.CELL_TICKS[ft.DENSITY_HD])
+	revolution = revolutions[0] if revolutions else []
+	return bytes(min(255, int(interval / cell + 0.5)) for interval in revolution), cell
+
+
+def flux_matches(a, b):
+	"""Whether two streams of track 0 head 0 are of the same disk. Most
+	stretches of flux in one must be in the other, reads of one disk only
+	differ by the odd misread, and other disks only share the gaps."""
+	runs, _ = cell_runs(a)
+	other, _ = cell_runs(b)
+	chunks = [runs[start:start + FLUX_CHUNK]
+		for start in range(0, len(runs) - FLUX_CHUNK + 1, FLUX_CHUNK)]
+	if not chunks:
+		return False
+	found = sum(1 for chunk in chunks if chunk in other)
+	return found >= FLUX_MATCH * len(chunks)
+
+
+class Fingerprint:
+	"""The index period in timer ticks, a hash of the sectors if all read
+	good, and the stream of the read, which is not stored with the job as
+	the job has it as its track 0 head 0."""
+
+	def __init__(self, period, sectors=None, track=None):
+		self.period = period
+		self.sectors = sectors
+		self.track = track
+
+	@classmethod
+	def from_track(cls, data):
+		"""From the stream of a read of track 0 head 0."""
+		_, revolutions = ft.decode_stream([ft.Frame(0, data, 0)])
+		_, cell = cell_runs(data)
+		found = {}
+		for revolution in revolutions:
+			found = mfm.merge_sectors(found, mfm.decode_sectors(revolution, cell))
+		sectors = None
+		if mfm.all_good(found):
+			content = hashlib.sha256()
+			for identity in sorted(found):
+				content.update(bytes(identity) + found[identity])
+			sectors = content.hexdigest()
+		period = sum(map(sum, revolutions)) // max(1, len(revolutions))
+		return cls(period, sectors, data)
+
+	def to_json(self):
+		return {"period": self.period, "sectors": self.sectors}
+
+	@classmethod
+	def from_json(cls, record):
+		return cls(record["period"], record["sectors"])
+
+	@property
+	def key(self):
+		"""Name for the job directory, matches() has the final say."""
+		return (self.sectors or hashlib.sha1(self.track or b"").hexdigest())[:16]
+
+	def matches(self, other):
+		if abs(self.period - other.period) > PERIOD_TOLERANCE * max(self.period, other.period, 1):
+			return False
+		if self.sectors and other.sectors:
+			return self.sectors == other.sectors
+		if self.track is None or other.track is None:
+			return False
+		return flux_matches(self.track, other.track)
+
+
+def fsync_directory(path):
+	fd = os.open(path, os.O_RDONLY)
+	try:
+		os.fsync(fd)
+	finally:
+		os.close(fd)
+
+
+def track_name(cylinder, head):
+	return "c%02dh%d.raw" % (cylinder, head)
+
+
+class Job:
+	"""One disk being imaged. tracks maps (cylinder, head) to the last log
+	record for that track."""
+
+	def __init__(self, path):
+		self.path = path
+		self.settings = None
+		self.fingerprint = None
+		self.tracks = {}
+		self.done = False
+		self.load()
+
+	def load(self):
+		log = os.path.join(self.path, LOG)
+		if not os.path.exists(log):
+			return
+		with open(log, "rb") as file:
+			data = file.read()
+		end = 0
+		for line in data.split(b"\n")[:-1]:
+			try:
+				record = json.loads(line)
+			except ValueError:
+				break
+			end += len(line) + 1
+			self.apply(record)
+		if end < len(data):
+			# torn write, cut it off so the next record starts on a fresh line
+			with open(log, "r+b") as file:
+				file.truncate(end)
+				os.fsync(file.fileno())
+
+	def apply(self, record):
+		event = record["event"]
+		if event == "start":
+			self.settings = record["settings"]
+			self.fingerprint = Fingerprint.from_json(record["fingerprint"])
+		elif event == "track":
+			self.tracks[(record["cylinder"], record["head"])] = record
+		elif event == "done":
+			self.done = True
+
+	def append(self, record):
+		log = os.path.join(self.path, LOG)
+		new = not os.path.exists(log)
+		with open(log, "ab") as file:
+			file.write(json.dumps(record, sort_keys=True).encode() + b"\n")
+			file.flush()
+			os.fsync(file.fileno())
+		if new:
+			fsync_directory(self.path)
+		self.apply(record)
+
+	def start(self, fingerprint, settings):
+		self.append({"event": "start", "fingerprint": fingerprint.to_json(),
+			"settings": settings})
+
+	def write_track(self, cylinder, head, data, bad, **extra):
+		"""Stores the stream of a track, bad lists the frames that failed their
+		crc, extra goes into the log record. The file is complete on disk
+		before the log points at it."""
+		name = track_name(cylinder, head)
+		fd, temporary = tempfile.mkstemp(dir=self.path, prefix=name, suffix=".tmp")
+		try:
+			with os.fdopen(fd, "wb") as file:
+				file.write(data)
+				file.flush()
+				os.fsync(file.fileno())
+			os.replace(temporary, os.path.join(self.path, name))
+		except BaseException:
+			if os.path.exists(temporary):
+				os.unlink(temporary)
+			raise
+		fsync_directory(self.path)
+		record = {"event": "track", "cylinder": cylinder, "head": head, "file": name,
+			"sha256": hashlib.sha256(data).hexdigest(), "bad": bad}
+		record.update(extra)
+		self.append(record)
+
+	def track_good(self, cylinder, head):
+		"""A track is good if it was read without bad frames and its file is
+		still the one that was logged."""
+		record = self.tracks.get((cylinder, head))
+		if record is None or record["bad"]:
+			return False
+		try:
+			with open(os.path.join(self.path, record["file"]), "rb") as file:
+				data = file.read()
+		except OSError:
+			return False
+		return hashlib.sha256(data).hexdigest() == record["sha256"]
+
+	def track_data(self, cylinder, head):
+		"""The stream of a track as it was stored, None if there is none."""
+		record = self.tracks.get((cylinder, head))
+		if record is None:
+			return None
+		try:
+			with open(os.path.join(self.path, record["file"]), "rb") as file:
+				return file.read()
+		except OSError:
+			return None
+
+	def missing(self):
+		"""The tracks that still have to be read, in reading order."""
+		return [(cylinder, head)
+			for cylinder in range(self.settings["cylinders"])
+			for head in range(self.settings["heads"])
+			if not self.track_good(cylinder, head)]
+
+	def finish(self):
+		self.append({"event": "done"})
+
+
+class JobStore:
+	def __init__(self, root):
+		self.root = root
+		os.makedirs(root, exist_ok=True)
+
+	def jobs(self):
+		for name in sorted(os.listdir(self.root)):
+			path = os.path.join(self.root, name)
+			if os.path.isdir(path):
+				job = Job(path)
+				if job.fingerprint is not None:
+					yield job
+
+	def find(self, fingerprint):
+		"""The job for the disk with this fingerprint, or None."""
+		for job in self.jobs():
+			job.fingerprint.track = job.track_data(0, 0)
+			if job.fingerprint.matches(fingerprint):
+				return job
+		return None
+
+	def open(self, fingerprint, settings):
+		"""Finds the job for a disk, or starts a new one."""
+		job = self.find(fingerprint)
+		if job is not None:
+			return job
+		path = os.path.join(self.root, fingerprint.key)
+		suffix = 1
+		while os.path.exists(path):
+			path = os.path.join(self.root, "%s-%d" % (fingerprint.key, suffix))
+			suffix += 1
+		os.mkdir(path)
+		fsync_directory(self.root)
+		job = Job(path)
+		job.start(fingerprint, settings)
+		return job
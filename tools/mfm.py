@@ -0,0 +1,164 @@
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+"""IBM format mfm tracks, as written by pc and most other drives, to and
+from flux intervals. Enough to tell which sectors of a revolution read
+with a good crc, and to make formatted disks for the simulator.
+
+Intervals are in timer ticks, cell is the ticks in an mfm bit cell, half
+a data bit."""
+
+SYNC = "0100010010001001"		# 0xa1 with a missing clock bit
+ID_MARK = 0xFE
+DATA_MARK = 0xFB
+DELETED_MARK = 0xF8
+
+
+def crc16(data, crc=0xFFFF):
+	"""Crc-16 ccitt, polynomial 0x1021, as the floppy controllers use it."""
+	for byte in data:
+		crc ^= byte << 8
+		for _ in range(8):
+			if crc & 0x8000:
+				crc = ((crc << 1) ^ 0x1021) & 0xFFFF
+			else:
+				crc = (crc << 1) & 0xFFFF
+	return crc
+
+
+#	after the three syncs
+SYNC_CRC = crc16(b"\xa1\xa1\xa1")
+
+
+def encode_bytes(data, last=0):
+	"""Mfm cells of data, last is the data bit before it. Returns the cells
+	as a string of 0 and 1, and the last data bit."""
+	cells = []
+	for byte in data:
+		for bit in range(7, -1, -1):
+			value = (byte >> bit) & 1
+			cells.append("01" if value else ("10" if not last else "00"))
+			last = value
+	return "".join(cells), last
+
+
+def encode_track(cylinder, head, sectors, size, gap3=54, bad=()):
+	"""Cells of a formatted track, sectors is the data of each, numbered
+	from 1, and size the size code, 128 << size bytes. The sectors numbered
+	in bad get a wrong data crc."""
+	parts = []
+	last = 0
+
+	def add(data):
+		nonlocal last
+		cells, last = encode_bytes(data, last)
+		parts.append(cells)
+
+	def mark(byte, fields, damage=0):
+		nonlocal last
+		add(bytes(12))
+		parts.append(SYNC * 3)
+		last = 1
+		crc = crc16(bytes([byte]) + fields, SYNC_CRC) ^ damage
+		add(bytes([byte]) + fields + crc.to_bytes(2, "big"))
+
+	add(b"\x4e" * 80)
+	for number, data in enumerate(sectors, 1):
+		mark(ID_MARK, bytes([cylinder, head, number, size]))
+		add(b"\x4e" * 22)
+		mark(DATA_MARK, data, 1 if number in bad else 0)
+		add(b"\x4e" * gap3)
+	add(b"\x4e" * 100)
+	return "".join(parts)
+
+
+def cells_to_intervals(cells, cell, jitter=None):
+	"""Flux intervals between the ones in cells. jitter is a function that
+	gives the ticks to add to each."""
+	intervals = []
+	run = 0
+	for value in cells:
+		run += 1
+		if value == "1":
+			interval = round(run * cell)
+			if jitter:
+				interval = max(1, interval + jitter())
+			intervals.append(interval)
+			run = 0
+	return intervals
+
+
+def intervals_to_cells(intervals, cell):
+	runs = {}
+	parts = []
+	for interval in intervals:
+		run = max(1, int(interval / cell + 0.5))
+		if run not in runs:
+			runs[run] = "0" * (run - 1) + "1"
+		parts.append(runs[run])
+	return "".join(parts)
+
+
+def read_bytes(cells, position, count):
+	"""count bytes from the data bits of cells at position, None if the
+	cells end first."""
+	if position + count * 16 > len(cells):
+		return None
+	return bytes(int(cells[start + 1:start + 16:2], 2)
+		for start in range(position, position + count * 16, 16))
+
+
+def decode_sectors(intervals, cell):
+	"""Decodes one revolution. Returns {(cylinder, head, sector, size): data}
+	for every sector with a readable id, data is None if the data did not
+	read with a good crc."""
+	cells = intervals_to_cells(intervals, cell)
+	sectors = {}
+	identity = None
+	position = cells.find(SYNC * 3)
+	while position >= 0:
+		position += len(SYNC) * 3
+		mark = read_bytes(cells, position, 1)
+		if mark is None:
+			break
+		if mark[0] == ID_MARK:
+			fields = read_bytes(cells, position, 7)
+			identity = None
+			if fields and crc16(fields, SYNC_CRC) == 0:
+				identity = tuple(fields[1:5])
+				sectors.setdefault(identity, None)
+		elif mark[0] in (DATA_MARK, DELETED_MARK) and identity:
+			length = 128 << min(identity[3], 7)
+			fields = read_bytes(cells, position, 3 + length)
+			if fields and crc16(fields, SYNC_CRC) == 0:
+				sectors[identity] = fields[1:-2]
+			identity = None
+		position = cells.find(SYNC * 3, position)
+	return sectors
+
+
+def merge_sectors(sectors, revolution):
+	"""Adds the sectors of a revolution to those of earlier ones, a sector
+	stays good once it read good."""
+	merged = dict(sectors)
+	for identity, data in revolution.items():
+		if merged.get(identity) is None:
+			merged[identity] = data
+	return merged
+
+
+def all_good(sectors):
+	return bool(sectors) and all(data is not None for data in sectors.values())
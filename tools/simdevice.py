@@ -0,0 +1,437 @@
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Simulated board on a pseudo terminal, for testing host tools without
+hardware. It answers the commands of the firmware and streams reads the
+way it does, frames, crcs and resends included, from a disk model that is
+either synthetic or replayed from recorded streams."""
+
+import collections
+import os
+import random
+import select
+import struct
+import threading
+import time
+import tty
+
+import floppything as ft
+import mfm
+import trace_to_json as tj
+
+#	states of main.c, for the trace
+STATE_DONE = 0x00
+STATE_READ = 0x05
+STATE_WINDOW = 0x0B
+
+CYCLES_PER_SECOND = 168000000
+
+#	command bytes after the command itself
+COMMAND_LENGTHS = {
+	ft.CMD_HALT: 0,
+	ft.CMD_SELECT_DRIVE: 1,
+	ft.CMD_CYLINDER: 1,
+	ft.CMD_HEAD: 1,
+	ft.CMD_CHECK_DISK: 0,
+	ft.CMD_MOTOR: 1,
+	ft.CMD_READ: 0,
+	ft.CMD_READ_MULTI: 1,
+	ft.CMD_READ_STOP: 0,
+	ft.CMD_READ_UNTIL: 1,
+	ft.CMD_DETECT_DENSITY: 0,
+	ft.CMD_SURVEY: 1,
+	ft.CMD_RESEND_FRAME: 2,
+	ft.CMD_READ_WINDOW: 6,
+	ft.CMD_TRACE_DUMP: 0,
+	ft.CMD_SERIAL: 0,
+	ft.CMD_HANDSHAKE: 0,
+}
+
+
+class Disk:
+	"""Flux intervals in timer ticks for each (cylinder, head), as a list of
+	revolutions. Reads go round the recorded revolutions."""
+
+	def __init__(self, tracks, density=1):
+		self.tracks = tracks
+		self.density = density
+
+	@classmethod
+	def synthetic(cls, cylinders=80, heads=2, intervals=2000, seed=0):
+		"""Mfm like flux at hd: 2, 3 and 4 bit cell intervals with jitter.
+		Revolutions are short, so tests stay quick."""
+		rng = random.Random(seed)
+		tracks = {}
+		for cylinder in range(cylinders):
+			for head in range(heads):
+				track = [rng.choice((34, 34, 50, 67)) for _ in range(intervals)]
+				tracks[(cylinder, head)] = [
+					[max(1, cell + rng.randint(-2, 2)) for cell in track] for _ in range(2)]
+		return cls(tracks)
+
+	@classmethod
+	def formatted(cls, cylinders=80, heads=2, sectors=9, size=1, seed=0, weak=()):
+		"""An mfm formatted hd disk with random data, few and small sectors
+		by default so tests stay quick. The (cylinder, head, sector) in weak
+		read with a bad crc on the first of the two revolutions."""
+		rng = random.Random(seed)
+		cell = ft.CELL_TICKS[ft.DENSITY_HD]
+		tracks = {}
+		for cylinder in range(cylinders):
+			for head in range(heads):
+				data = [bytes(rng.randrange(256) for _ in range(128 << size))
+					for _ in range(sectors)]
+				revolutions = []
+				for turn in range(2):
+					bad = [number for number in range(1, sectors + 1)
+						if turn == 0 and (cylinder, head, number) in weak]
+					cells = mfm.encode_track(cylinder, head, data, size, bad=bad)
+					revolutions.append(mfm.cells_to_intervals(cells, cell,
+						lambda: rng.randint(-2, 2)))
+				tracks[(cylinder, head)] = revolutions
+		return cls(tracks)
+
+	@classmethod
+	def from_recordings(cls, directory):
+		"""Replays streams recorded with image_disk.py, one file per track
+		named c<cylinder>h<head>.raw holding the frame bytes."""
+		tracks = {}
+		for name in os.listdir(directory):
+			if not (name.startswith("c") and name.endswith(".raw")):
+				continue
+			cylinder, head = name[1:-4].split("h")
+			with open(os.path.join(directory, name), "rb") as recording:
+				data = recording.read()
+			_, revolutions = ft.decode_stream([ft.Frame(0, data, 0)])
+			tracks[(int(cylinder), int(head))] = revolutions
+		return cls(tracks)
+
+
+def encode_intervals(intervals):
+	data = bytearray()
+	for interval in intervals:
+		overflows, rest = divmod(interval, ft.TIMER_PERIOD)
+		data += bytes([ft.MSG_OVERFLOW]) * overflows
+		data.append(ft.TIMER_TOP - rest)
+	return data
+
+
+class SimulatedDevice:
+	"""Runs a simulated board on the master side of a pseudo terminal, the
+	host opens self.path. corrupt is the chance that a frame is damaged on
+	its way to the host, to exercise crc checks and resends. overrun is the
+	chance that one is overwritten in the out buffer before it is sent.
+	buffer_size is how much of the last stream can be resent, like the out
+	buffer. CMD_READ_UNTIL waits revolution_time after each revolution for
+	the host to stop it, CMD_READ_STOP outside of one does nothing. trace
+	is whether it answers CMD_TRACE_DUMP, like a build with TRACE=1, with
+	the states, index edges and usb packets of its reads."""
+
+	def __init__(self, disk, serial="SIM000000000000000000000", corrupt=0.0,
+			buffer_size=98304, seed=0, rate=None, overrun=0.0, revolution_time=0.02,
+			trace=True):
+		self.disk = disk
+		self.serial = serial
+		self.corrupt = corrupt
+		self.overrun = overrun
+		self.revolution_time = revolution_time	# seconds, for the host to stop a read in
+		self.buffer_size = buffer_size
+		self.rate = rate		# bytes per second, None is as fast as possible
+		self.rng = random.Random(seed)
+		self.cylinder = 0
+		self.head = 0
+		self.disk_present = True
+		self.disk_ejected = False
+		self.disk_change = False	# the drive's change line, cleared by a step with a disk in
+		self.read_count = 0
+		self.frames = []		# frames of the last stream, with their crc
+		self.overrun_frames = set()
+		self.bytes_sent = 0
+		self.stream_sent = 0	# bytes of the last stream, for its usb packets
+		self.trace = collections.deque(maxlen=tj.TRACE_SIZE) if trace else None
+		self.buffer = bytearray()		# commands not handled yet
+		self.master, slave = os.openpty()
+		tty.setraw(slave)
+		self.path = os.ttyname(slave)
+		self.slave = slave
+		self.running = True
+		self.thread = threading.Thread(target=self.run, daemon=True)
+		self.thread.start()
+
+	def close(self):
+		self.running = False
+		self.thread.join()
+		os.close(self.master)
+		os.close(self.slave)
+
+	def __enter__(self):
+		return self
+
+	def __exit__(self, *exception):
+		self.close()
+
+	def eject(self):
+		"""The disk is swapped. Like on a drive, the change line stays active
+		until the head steps."""
+		self.disk_ejected = True
+		self.disk_change = True
+
+	def send(self, data):
+		view = memoryview(bytes(data))
+		while view:
+			written = os.write(self.master, view[:4096])
+			view = view[written:]
+		self.bytes_sent += len(data)
+		if self.rate:
+			threading.Event().wait(len(data) / self.rate)
+
+	def trace_event(self, event, value):
+		if self.trace is not None:
+			cycles = int(time.monotonic() * CYCLES_PER_SECOND) & 0xffffffff
+			self.trace.append((cycles, event, value & 0xff))
+
+	def trace_index(self, level):
+		"""The index interrupt, level is that of the pin, low in the pulse."""
+		self.trace_event(tj.TRACE_INDEX_ENTER, 0)
+		self.trace_event(tj.TRACE_INDEX_EDGE, level)
+		self.trace_event(tj.TRACE_INDEX_EXIT, 0)
+
+	def trace_dump(self):
+		if self.trace is None:
+			self.send([ft.MSG_INVALID_CMD])
+			return
+		events = list(self.trace)
+		self.trace.clear()
+		self.send(tj.HEADER.pack(ft.MSG_TRACE, len(events), CYCLES_PER_SECOND) +
+			b"".join(tj.EVENT.pack(cycles, event, value, 0) for cycles, event, value in events))
+
+	def read_command(self):
+		buffer = self.buffer
+		while True:
+			if buffer:
+				length = COMMAND_LENGTHS.get(buffer[0])
+				if length is None:
+					del buffer[0]
+					self.send([ft.MSG_INVALID_CMD])
+					continue
+				if len(buffer) > length:
+					command = bytes(buffer[:length + 1])
+					del buffer[:length + 1]
+					return command
+			ready, _, _ = select.select([self.master], [], [], 0.05)
+			if not self.running:
+				return None
+			if ready:
+				try:
+					buffer += os.read(self.master, 256)
+				except OSError:
+					return None
+
+	def run(self):
+		while self.running:
+			command = self.read_command()
+			if command is None:
+				return
+			self.handle(command)
+
+	def handle(self, command):
+		code = command[0]
+		if code == ft.CMD_HANDSHAKE:
+			self.send(ft.HANDSHAKE_REPLY)
+		elif code == ft.CMD_SERIAL:
+			self.send(bytes([ft.MSG_SERIAL]) + self.serial.encode("ascii"))
+		elif code in (ft.CMD_SELECT_DRIVE, ft.CMD_HEAD):
+			if code == ft.CMD_HEAD:
+				self.head = command[1]
+			self.send([ft.MSG_DONE])
+		elif code == ft.CMD_CYLINDER:
+			if command[1] != self.cylinder and self.disk_present:
+				self.disk_change = False
+			self.cylinder = command[1]
+			self.send([ft.MSG_DONE])
+		elif code == ft.CMD_MOTOR:
+			if command[1]:
+				self.send([ft.MSG_DONE])
+		elif code == ft.CMD_CHECK_DISK:
+			if not self.disk_present or self.disk_change:
+				self.send([ft.MSG_NO_DISK])
+			elif self.disk_ejected:
+				self.disk_ejected = False
+				self.send([ft.MSG_DISK_EJECTED])
+			else:
+				self.send([ft.MSG_DISK_LOADED])
+		elif code in (ft.CMD_READ, ft.CMD_READ_MULTI):
+			self.read(1 if code == ft.CMD_READ else command[1])
+		elif code == ft.CMD_READ_UNTIL:
+			self.read(command[1], until=True)
+		elif code == ft.CMD_READ_WINDOW:
+			self.read_window(int.from_bytes(command[1:4], "little"),
+				int.from_bytes(command[4:7], "little"))
+		elif code == ft.CMD_RESEND_FRAME:
+			self.resend(struct.unpack("<H", command[1:3])[0])
+		elif code == ft.CMD_SURVEY:
+			self.survey(command[1])
+		elif code == ft.CMD_TRACE_DUMP:
+			self.trace_dump()
+
+	def track(self):
+		revolutions = self.disk.tracks.get((self.cylinder, self.head))
+		if not revolutions:
+			# blank track, nothing but overflows
+			revolutions = [[ft.TIMER_PERIOD * 8] * 2000]
+		return revolutions
+
+	def read(self, count, until=False):
+		revolutions = self.track()
+		first = self.read_count
+		self.read_count += 1
+		# lead in, a random tail of the revolution before the index
+		lead_in = revolutions[first % len(revolutions)]
+		lead_in = lead_in[-self.rng.randint(1, len(lead_in)):]
+		# like the firmware, the capture timer stops at each index edge, the
+		# count so far goes out before the marker and counting starts again
+		# after it. The pulse starts in the first interval of a revolution
+		# and ends in the second.
+		turns = [revolutions[(first + turn) % len(revolutions)] for turn in range(count + 1)]
+		starts = [self.rng.randint(0, turn[0] - 1) for turn in turns]
+		self.start_stream(STATE_READ)
+		self.stream_frame(bytes([ft.MSG_STREAM_HEADER, self.disk.density]) +
+			encode_intervals(lead_in + starts[:1]) + bytes([ft.MSG_FRAME_END]))
+		for turn, revolution in enumerate(turns):
+			end = self.rng.randint(0, revolution[1] - 1)
+			payload = (bytes([ft.MSG_INDEX_ON]) +
+				encode_intervals([revolution[0] - starts[turn], end]) +
+				bytes([ft.MSG_INDEX_OFF]))
+			self.trace_index(0)
+			self.trace_index(1)
+			# a stop is honoured once a whole revolution is in
+			if turn == count or (until and turn > 0 and self.stop_requested()):
+				self.stream_frame(payload + bytes([ft.MSG_DONE]))
+				self.trace_event(tj.TRACE_STATE, STATE_DONE)
+				break
+			self.stream_frame(payload +
+				encode_intervals([revolution[1] - end] + revolution[2:] + starts[turn + 1:turn + 2]) +
+				bytes([ft.MSG_FRAME_END]))
+
+	def read_window(self, start, length):
+		"""Like the firmware, the capture timer starts at start ticks after
+		the index and stops at start + length, the count so far goes out
+		before MSG_DONE."""
+		revolutions = self.track()
+		first = self.read_count
+		self.read_count += 1
+		start = max(start, 1)
+		end = start + length
+		# flux transitions after the index, which falls in the first interval
+		position = -self.rng.randint(0, revolutions[first % len(revolutions)][0] - 1)
+		last = start
+		intervals = []
+		turn = first
+		while position <= end:
+			for interval in revolutions[turn % len(revolutions)]:
+				position += interval
+				if start < position <= end:
+					intervals.append(position - last)
+					last = position
+			turn += 1
+		self.start_stream(STATE_WINDOW)
+		self.trace_index(0)
+		self.stream_frame(bytes([ft.MSG_STREAM_HEADER, self.disk.density,
+			ft.MSG_INDEX_ON, ft.MSG_WINDOW_START]) + encode_intervals(intervals + [end - last]) +
+			bytes([ft.MSG_DONE]))
+		self.trace_event(tj.TRACE_STATE, STATE_DONE)
+
+	def start_stream(self, state):
+		self.frames = []
+		self.overrun_frames = set()
+		self.stream_sent = 0
+		self.trace_event(tj.TRACE_STATE, state)
+
+	def stop_requested(self):
+		"""Waits out a revolution, and tells if the host asked to stop by
+		then, like CMD_READ_STOP on the board."""
+		deadline = time.monotonic() + self.revolution_time
+		while True:
+			if self.buffer[:1] == bytes([ft.CMD_READ_STOP]):
+				del self.buffer[0]
+				return True
+			remaining = deadline - time.monotonic()
+			if remaining <= 0:
+				return False
+			ready, _, _ = select.select([self.master], [], [], remaining)
+			if ready:
+				self.buffer += os.read(self.master, 256)
+
+	def stream_frame(self, data):
+		number = len(self.frames)
+		crc = ft.stream_crc(data)
+		self.frames.append((data, crc))
+		if self.overrun and self.rng.random() < self.overrun:
+			self.send_overrun(number, data)
+		else:
+			self.send_frame(number, data, crc)
+		# the out buffer goes out in 64 byte usb packets
+		sent = self.stream_sent + len(data) + ft.FRAME_CRC.size
+		for packet in range(self.stream_sent >> 6, sent >> 6):
+			self.trace_event(tj.TRACE_USB_PACKET, packet + 1)
+		self.stream_sent = sent
+
+	def send_overrun(self, number, data):
+		# newer flux in place of the frame, only its end is kept
+		self.overrun_frames.add(number)
+		lost = bytes(self.rng.randrange(ft.TIMER_PERIOD) for _ in data[:-1]) + data[-1:]
+		self.send(lost + ft.FRAME_CRC.pack(ft.MSG_FRAME_OVERRUN, number, ft.stream_crc(lost)))
+
+	def send_frame(self, number, data, crc):
+		if self.corrupt and self.rng.random() < self.corrupt:
+			# damage a data byte, so the framing survives
+			damaged = bytearray(data)
+			position = self.rng.choice([index for index, byte in enumerate(damaged)
+				if byte < ft.TIMER_PERIOD])
+			damaged[position] ^= 0x01
+			data = bytes(damaged)
+		self.send(data + ft.FRAME_CRC.pack(ft.MSG_FRAME_CRC, number, crc))
+
+	def resend(self, number):
+		kept = 0
+		available = set()
+		for index in range(len(self.frames) - 1, -1, -1):
+			kept += len(self.frames[index][0])
+			if kept > self.buffer_size:
+				break
+			available.add(index)
+		if number not in available or number in self.overrun_frames:
+			self.send([ft.MSG_RESEND_FAILED])
+			return
+		data, crc = self.frames[number]
+		self.send_frame(number, data, crc)
+
+	def survey(self, last_cylinder):
+		if last_cylinder > ft.LAST_CYLINDER:
+			self.send([ft.MSG_INVALID_CMD])
+			return
+		for cylinder in range(last_cylinder + 1):
+			for head in range(2):
+				self.cylinder, self.head = cylinder, head
+				revolution = self.track()[0]
+				histogram = [0] * 48
+				for interval in revolution:
+					if interval < ft.TIMER_PERIOD:
+						histogram[interval >> 2] += 1
+				period = sum(revolution) * 1000000 // 16800000
+				self.send(ft.SURVEY_REPORT.pack(ft.MSG_SURVEY, cylinder, head, period,
+					len(revolution), *[min(count, 0xffff) for count in histogram]))
+		self.send([ft.MSG_DONE])
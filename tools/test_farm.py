@@ -0,0 +1,141 @@
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+import asyncio
+import concurrent.futures
+import tempfile
+import time
+import unittest
+
+import farm
+import simdevice
+from jobstore import JobStore
+
+UNITS = 8
+SETTINGS = {"cylinders": 3, "heads": 2, "revolutions": 1}
+
+
+def disk(number):
+	return simdevice.Disk.formatted(cylinders=3, sectors=2, seed=number)
+
+
+class FarmTest(unittest.TestCase):
+	def setUp(self):
+		self.directory = tempfile.TemporaryDirectory()
+		self.store = JobStore(self.directory.name)
+		self.sims = []
+		self.pool = concurrent.futures.ProcessPoolExecutor(2)
+
+	def tearDown(self):
+		self.pool.shutdown()
+		for sim in self.sims:
+			sim.close()
+		self.directory.cleanup()
+
+	def start(self, count, **options):
+		for number in range(count):
+			self.sims.append(simdevice.SimulatedDevice(disk(number),
+				serial="SIM%021d" % number, seed=number, **options))
+
+	def run_farm(self, paths, once=True):
+		log = []
+
+		async def run():
+			units = await farm.discover(paths)
+			try:
+				started = time.monotonic()
+				throughput = await farm.Farm(units, self.store, self.pool, **SETTINGS,
+					log=log.append).run(once)
+				return units, throughput, time.monotonic() - started
+			finally:
+				for unit in units:
+					unit.close()
+		return asyncio.run(run()) + (log,)
+
+	def test_discover(self):
+		# a file that is no board, and a board seen twice
+		self.start(2)
+
+		async def discover(paths):
+			units = await farm.discover(paths)
+			for unit in units:
+				unit.close()
+			return [unit.serial for unit in units]
+		with tempfile.NamedTemporaryFile() as other:
+			serials = asyncio.run(discover(
+				[self.sims[0].path, other.name, self.sims[1].path, self.sims[0].path]))
+		self.assertEqual(serials, [self.sims[0].serial, self.sims[1].serial])
+
+	def test_units_in_parallel(self):
+		# slow links, so the time goes into the io and not the tests
+		self.start(UNITS, rate=100000)
+		units, throughput, elapsed, log = self.run_farm([sim.path for sim in self.sims])
+		self.assertEqual(len(units), UNITS)
+		jobs = list(self.store.jobs())
+		self.assertEqual(len(jobs), UNITS)
+		for job in jobs:
+			self.assertTrue(job.done)
+			for record in job.tracks.values():
+				self.assertEqual(record["revolutions"], 1)
+		for stats in throughput:
+			self.assertEqual(stats["tracks"], 6)
+			self.assertGreater(stats["bytes/s"], 0)
+		# one unit at a time would take the sum of the busy times
+		self.assertGreater(sum(stats["busy"] for stats in throughput), 3 * elapsed)
+		self.assertEqual(len(farm.Farm(units, self.store, self.pool).throughput_lines()), UNITS)
+
+	def test_bad_unit_does_not_stop_others(self):
+		self.start(UNITS)
+		self.sims[3].corrupt = 1.0
+		self.sims[5].disk_present = False
+		units, throughput, _, _ = self.run_farm([sim.path for sim in self.sims])
+		tracks = {stats["unit"]: (stats["tracks"], stats["bad tracks"]) for stats in throughput}
+		self.assertEqual(tracks[self.sims[3].serial], (6, 6))
+		self.assertEqual(tracks[self.sims[5].serial], (0, 0))
+		done = [job for job in self.store.jobs() if job.done]
+		self.assertEqual(len(done), UNITS - 2)
+
+	def test_disk_swapped_while_imaging(self):
+		self.start(1, rate=200000)
+		sim = self.sims[0]
+		log = []
+
+		async def run():
+			units = await farm.discover([sim.path])
+			serving = asyncio.ensure_future(farm.Farm(units, self.store, self.pool, **SETTINGS,
+				log=log.append).run())
+			try:
+				while sim.read_count < 2:
+					await asyncio.sleep(0.01)
+				# the farm keeps serving, the new disk is imaged without another swap
+				sim.disk = disk(1)
+				sim.eject()
+				while not any(job.done for job in self.store.jobs()):
+					await asyncio.sleep(0.05)
+			finally:
+				serving.cancel()
+				await asyncio.gather(serving, return_exceptions=True)
+				for unit in units:
+					unit.close()
+		asyncio.run(asyncio.wait_for(run(), 30))
+		jobs = list(self.store.jobs())
+		self.assertEqual(len(jobs), 2)
+		self.assertEqual([job.done for job in jobs].count(True), 1)
+		self.assertTrue(any(line.endswith("disk changed") for line in log))
+
+
+if __name__ == "__main__":
+	unittest.main()
@@ -0,0 +1,252 @@
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Run with python3 -m unittest discover tools"""
+
+import os
+import shutil
+import struct
+import subprocess
+import tempfile
+import unittest
+
+import floppything as ft
+import mfm
+import simdevice
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+CRC_MAIN = r"""
+#include <stdio.h>
+#include <string.h>
+#include "crc.h"
+
+int main(void)
+{
+	uint32_t words[64] = {0};
+	uint32_t count;
+
+	// the tail of the last word stays zero, as in the firmware
+	count = fread(words, 1, sizeof(words), stdin);
+	frame_crc_reset();
+	frame_crc_add(words, (count + 3) / 4);
+	printf("%08x\n", frame_crc_value());
+	return 0;
+}
+"""
+
+
+class CrcTest(unittest.TestCase):
+	def test_vector(self):
+		# crc-32/mpeg-2 of "12345678", the crc unit with big endian words
+		self.assertEqual(ft.stream_crc(struct.pack("<II", 0x31323334, 0x35363738)), 0x49e3c2fb)
+
+	def test_fallback_matches(self):
+		compiler = shutil.which("cc") or shutil.which("gcc")
+		if compiler is None:
+			self.skipTest("no host compiler")
+		with tempfile.TemporaryDirectory() as directory:
+			source = os.path.join(directory, "crc_main.c")
+			binary = os.path.join(directory, "crc_main")
+			with open(source, "w") as file:
+				file.write(CRC_MAIN)
+			subprocess.run([compiler, "-Wall", "-Werror", "-I", REPO, "-o", binary, source], check=True)
+			for data in (b"12345678", b"123456789", bytes(range(64)), bytes([0x69]) * 255):
+				output = subprocess.run([binary], input=data, stdout=subprocess.PIPE, check=True).stdout
+				self.assertEqual(int(output, 16), ft.stream_crc(data))
+
+
+class StreamTest(unittest.TestCase):
+	def test_decode_firmware_layout(self):
+		# the index pulse starts 10 ticks into the revolution's first interval
+		# and ends in its second, the next revolution starts 7 ticks into 80
+		data = bytes([ft.MSG_STREAM_HEADER, 1, 0xbf - 50, 0xbf - 10, ft.MSG_FRAME_END])
+		data += bytes([ft.MSG_INDEX_ON, 0xbf - 90, ft.MSG_OVERFLOW, 0xbf - 5,
+			ft.MSG_INDEX_OFF, 0xbf - 55, ft.MSG_OVERFLOW, 0xbf - 0x20, 0xbf - 7,
+			ft.MSG_FRAME_END])
+		data += bytes([ft.MSG_INDEX_ON, 0xbf - 73, 0xbf - 3, ft.MSG_INDEX_OFF, ft.MSG_DONE])
+		lead_in, revolutions = ft.decode_stream([ft.Frame(0, data, 0)])
+		self.assertEqual(lead_in, [50])
+		self.assertEqual(revolutions, [[100, 0xc5 + 55, 0xc0 + 0x20]])
+
+	def test_decode_round_trip(self):
+		disk = simdevice.Disk.synthetic(cylinders=1, heads=1, intervals=500)
+		disk.tracks[(0, 0)][0] += [400, 1000]		# overflows too
+		with simdevice.SimulatedDevice(disk) as sim:
+			with ft.Link(sim.path) as link:
+				frames, _ = ft.Device(link).read_track(3)
+		_, revolutions = ft.decode_stream(frames)
+		self.assertEqual(revolutions, [disk.tracks[(0, 0)][turn % 2] for turn in range(3)])
+
+
+class ReadUntilTest(unittest.TestCase):
+	def read(self, disk, revolutions, **options):
+		with simdevice.SimulatedDevice(disk, revolution_time=0.2, **options) as sim:
+			with ft.Link(sim.path) as link:
+				frames, bad = ft.Device(link).read_until_good(revolutions)
+		self.assertEqual(bad, [])
+		return ft.decode_stream(frames)[1]
+
+	def test_stops_once_sectors_good(self):
+		disk = simdevice.Disk.formatted(cylinders=1, heads=1, weak={(0, 0, 2)})
+		revolutions = self.read(disk, 8)
+		# the weak sector reads good on the second, the stop lands by the third
+		self.assertIn(len(revolutions), (2, 3))
+		sectors = {}
+		for revolution in revolutions:
+			sectors = mfm.merge_sectors(sectors, mfm.decode_sectors(revolution, 16.8))
+		self.assertTrue(mfm.all_good(sectors))
+		self.assertEqual(len(sectors), 9)
+
+	def test_unformatted_reads_all(self):
+		disk = simdevice.Disk.synthetic(cylinders=1, heads=1, intervals=500)
+		self.assertEqual(len(self.read(disk, 3)), 3)
+
+
+class WindowTest(unittest.TestCase):
+	def test_read_window(self):
+		disk = simdevice.Disk.synthetic(cylinders=1, heads=1, intervals=2000)
+		with simdevice.SimulatedDevice(disk) as sim:
+			with ft.Link(sim.path) as link:
+				frames, bad = ft.Device(link).read_window(20000, 3000)
+		self.assertEqual(bad, [])
+		self.assertEqual(len(frames), 1)
+		intervals = ft.decode_window(frames)
+		# from the window start, whole intervals of the track, and not past its end
+		self.assertLessEqual(sum(intervals), 3000)
+		self.assertGreater(sum(intervals), 3000 - 80)
+		track = disk.tracks[(0, 0)][0]
+		inside = intervals[1:]
+		self.assertTrue(any(track[index:index + len(inside)] == inside
+			for index in range(len(track))))
+
+	def test_decode_window_firmware_layout(self):
+		data = bytes([ft.MSG_STREAM_HEADER, 1, ft.MSG_INDEX_ON, ft.MSG_WINDOW_START,
+			0xbf - 10, ft.MSG_OVERFLOW, 0xbf - 5, 0xbf - 40, 0xbf - 7, ft.MSG_DONE])
+		self.assertEqual(ft.decode_window([ft.Frame(0, data, 0)]), [10, 0xc5, 40])
+		# no window start, nothing was captured
+		data = bytes([ft.MSG_STREAM_HEADER, 1, ft.MSG_DONE])
+		self.assertEqual(ft.decode_window([ft.Frame(0, data, 0)]), [])
+
+	def test_index_timeout(self):
+		device = ft.Device(ft.Recording(bytes([ft.MSG_INDEX_TIMEOUT])))
+		self.assertEqual(device.read_window(100, 100), ([], []))
+
+
+class SurveyTest(unittest.TestCase):
+	def test_survey(self):
+		disk = simdevice.Disk.synthetic(cylinders=2, intervals=500)
+		with simdevice.SimulatedDevice(disk) as sim:
+			with ft.Link(sim.path) as link:
+				reports = ft.Device(link).survey(1)
+		self.assertEqual(sorted(reports), [(0, 0), (0, 1), (1, 0), (1, 1)])
+		for period, transitions, histogram in reports.values():
+			self.assertEqual(transitions, 500)
+
+	def test_past_last_cylinder(self):
+		device = ft.Device(ft.Recording(bytes([ft.MSG_INVALID_CMD])))
+		with self.assertRaises(ft.ProtocolError):
+			device.survey(ft.LAST_CYLINDER + 1)
+		with simdevice.SimulatedDevice(simdevice.Disk.synthetic(cylinders=1)) as sim:
+			with ft.Link(sim.path) as link:
+				with self.assertRaises(ft.ProtocolError):
+					ft.Device(link).survey(ft.LAST_CYLINDER + 1)
+
+
+class Tee:
+	"""Records what is read from a link."""
+
+	def __init__(self, link):
+		self.link = link
+		self.recording = bytearray()
+
+	def read(self, length, timeout=None):
+		data = self.link.read(length, timeout)
+		self.recording += data
+		return data
+
+	def read_until(self, markers, timeout=None):
+		data = self.link.read_until(markers, timeout)
+		self.recording += data
+		return data
+
+
+class ResendTest(unittest.TestCase):
+	def setUp(self):
+		self.disk = simdevice.Disk.synthetic(cylinders=2, heads=2)
+
+	def read(self, sim, revolutions):
+		with ft.Link(sim.path) as link:
+			device = ft.Device(link)
+			self.assertTrue(device.handshake())
+			return device.read_track(revolutions)
+
+	def test_clean_read(self):
+		with simdevice.SimulatedDevice(self.disk) as sim:
+			frames, bad = self.read(sim, 3)
+		self.assertEqual(bad, [])
+		self.assertEqual(len(frames), 5)
+		_, revolutions = ft.decode_stream(frames)
+		self.assertEqual(revolutions, [self.disk.tracks[(0, 0)][turn % 2] for turn in range(3)])
+
+	def test_recorded_frames(self):
+		# record a stream once, then check the crcs of the recording offline
+		with simdevice.SimulatedDevice(self.disk) as sim:
+			with ft.Link(sim.path) as link:
+				link.write([ft.CMD_READ_MULTI, 2])
+				tee = Tee(link)
+				ft.Device(tee).read_stream()
+		frames = ft.Device(ft.Recording(tee.recording)).read_stream()
+		self.assertEqual([frame.number for frame in frames], [0, 1, 2, 3])
+		self.assertTrue(all(frame.good for frame in frames))
+		frames[1].data = frames[1].data[:5] + bytes([frames[1].data[5] ^ 1]) + frames[1].data[6:]
+		self.assertFalse(frames[1].good)
+
+	def test_corrupt_frames_resent(self):
+		with simdevice.SimulatedDevice(self.disk, corrupt=0.5, seed=2) as sim:
+			frames, bad = self.read(sim, 4)
+		self.assertEqual(bad, [])
+		self.assertTrue(all(frame.good for frame in frames))
+		_, revolutions = ft.decode_stream(frames)
+		self.assertEqual(len(revolutions), 4)
+
+	def test_overrun_not_resent(self):
+		with simdevice.SimulatedDevice(self.disk, overrun=0.5, seed=1) as sim:
+			frames, bad = self.read(sim, 4)
+			sent = sim.bytes_sent
+		self.assertEqual(bad, sorted(sim.overrun_frames))
+		self.assertTrue(bad)
+		self.assertTrue(all(frames[number].overrun for number in bad))
+		self.assertTrue(frames[-1].last)
+		# only the stream went out, no resends
+		self.assertEqual(sent, sum(len(frame.data) + ft.FRAME_CRC.size for frame in frames) +
+			len(ft.HANDSHAKE_REPLY))
+
+	def test_resend_past_buffer(self):
+		# only the last frames fit in the buffer, the first can not be resent
+		with simdevice.SimulatedDevice(self.disk, buffer_size=4096) as sim:
+			with ft.Link(sim.path) as link:
+				link.write([ft.CMD_READ_MULTI, 2])
+				device = ft.Device(link)
+				frames = device.read_stream()
+				self.assertIsNone(device.resend(0))
+				again = device.resend(len(frames) - 1)
+		self.assertTrue(again.good)
+		self.assertEqual(again.data, frames[-1].data)
+
+
+if __name__ == "__main__":
+	unittest.main()
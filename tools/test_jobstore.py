@@ -0,0 +1,191 @@
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+import os
+import tempfile
+import unittest
+
+import floppything as ft
+import image_disk
+import simdevice
+from jobstore import LOG, Fingerprint, Job, JobStore
+
+SETTINGS = {"cylinders": 3, "heads": 2, "revolutions": 1}
+
+
+class Crash(Exception):
+	pass
+
+
+def read_track(sim, cylinder=0, head=0, revolutions=2):
+	with ft.Link(sim.path) as link:
+		device = ft.Device(link)
+		device.seek(cylinder)
+		device.head(head)
+		frames, _ = device.read_track(revolutions)
+	return b"".join(frame.data for frame in frames)
+
+
+class FingerprintTest(unittest.TestCase):
+	def fingerprint(self, disk, seed=0):
+		with simdevice.SimulatedDevice(disk, seed=seed) as sim:
+			return Fingerprint.from_track(read_track(sim))
+
+	def test_formatted(self):
+		# the same format with other data does not match
+		disk = simdevice.Disk.formatted(cylinders=1, sectors=4, seed=1)
+		a = self.fingerprint(disk)
+		self.assertIsNotNone(a.sectors)
+		self.assertTrue(a.matches(self.fingerprint(disk, seed=1)))
+		other = self.fingerprint(simdevice.Disk.formatted(cylinders=1, sectors=4, seed=2))
+		self.assertAlmostEqual(a.period, other.period, delta=a.period * 0.01)
+		self.assertFalse(a.matches(other))
+		self.assertTrue(a.matches(Fingerprint.from_json(a.to_json())))
+
+	def test_unformatted(self):
+		# no sectors, the flux of the track is compared
+		disk = simdevice.Disk.synthetic(cylinders=1, intervals=3000, seed=1)
+		a = self.fingerprint(disk)
+		self.assertIsNone(a.sectors)
+		self.assertTrue(a.matches(self.fingerprint(disk, seed=1)))
+		self.assertFalse(a.matches(self.fingerprint(
+			simdevice.Disk.synthetic(cylinders=1, intervals=3000, seed=2))))
+		# a stored one has no stream of its own, the job has
+		self.assertFalse(Fingerprint.from_json(a.to_json()).matches(a))
+
+
+class JobTest(unittest.TestCase):
+	def setUp(self):
+		self.directory = tempfile.TemporaryDirectory()
+		self.store = JobStore(self.directory.name)
+		self.fingerprint = Fingerprint(200000, "ab" * 32)
+
+	def tearDown(self):
+		self.directory.cleanup()
+
+	def test_torn_line_dropped(self):
+		job = self.store.open(self.fingerprint, SETTINGS)
+		job.write_track(0, 0, b"\x10" * 64, [])
+		with open(os.path.join(job.path, LOG), "ab") as file:
+			file.write(b'{"event": "track", "cyl')
+		job = Job(job.path)
+		self.assertEqual(list(job.tracks), [(0, 0)])
+		job.write_track(0, 1, b"\x11" * 64, [])
+		self.assertEqual(sorted(Job(job.path).tracks), [(0, 0), (0, 1)])
+
+	def test_reopened_by_fingerprint(self):
+		job = self.store.open(self.fingerprint, SETTINGS)
+		again = self.store.open(Fingerprint(200100, "ab" * 32), SETTINGS)
+		self.assertEqual(job.path, again.path)
+		other = self.store.open(Fingerprint(200000, "cd" * 32), SETTINGS)
+		self.assertNotEqual(job.path, other.path)
+
+	def test_reopened_by_stored_track(self):
+		disk = simdevice.Disk.synthetic(cylinders=1, intervals=3000, seed=1)
+		with simdevice.SimulatedDevice(disk) as sim:
+			data = read_track(sim)
+			again = Fingerprint.from_track(read_track(sim))
+		job = self.store.open(Fingerprint.from_track(data), SETTINGS)
+		job.write_track(0, 0, data, [])
+		self.assertEqual(self.store.open(again, SETTINGS).path, job.path)
+
+
+class ImageTest(unittest.TestCase):
+	def setUp(self):
+		self.directory = tempfile.TemporaryDirectory()
+		self.store = JobStore(self.directory.name)
+		self.disk = simdevice.Disk.synthetic(cylinders=3, intervals=500, seed=1)
+		self.sim = simdevice.SimulatedDevice(self.disk)
+		self.link = ft.Link(self.sim.path)
+		self.device = ft.Device(self.link)
+
+	def tearDown(self):
+		self.link.close()
+		self.sim.close()
+		self.directory.cleanup()
+
+	def image(self, log=None):
+		return image_disk.image(self.device, self.store, **SETTINGS, log=log)
+
+	def crash_after(self, tracks):
+		count = [0]
+
+		def log(message):
+			if message.startswith("c"):
+				count[0] += 1
+				if count[0] == tracks:
+					raise Crash()
+		return log
+
+	def test_resume_reads_only_missing(self):
+		with self.assertRaises(Crash):
+			self.image(self.crash_after(2))
+		self.assertEqual(self.sim.read_count, 2)
+		# the read of track 0 head 0 that finds the job is extra from here on
+		job = self.image()
+		self.assertTrue(job.done)
+		self.assertEqual(self.sim.read_count, 7)
+		# nothing left to do
+		self.image()
+		self.assertEqual(self.sim.read_count, 8)
+
+	def test_bad_and_damaged_tracks_read_again(self):
+		self.sim.corrupt = 1.0
+		job = self.image()
+		self.assertFalse(job.done)
+		self.assertEqual(len(job.missing()), 6)
+		self.sim.corrupt = 0.0
+		job = self.image()
+		self.assertTrue(job.done)
+		with open(os.path.join(job.path, job.tracks[(1, 1)]["file"]), "r+b") as file:
+			file.write(b"\x00")
+		reads = self.sim.read_count
+		self.image()
+		self.assertEqual(self.sim.read_count, reads + 2)
+
+	def test_disk_swap(self):
+		with self.assertRaises(Crash):
+			self.image(self.crash_after(2))
+		# another disk goes in, it gets a job of its own
+		self.sim.disk = simdevice.Disk.synthetic(cylinders=3, intervals=600, seed=2)
+		self.sim.eject()
+		# not seen until the head steps
+		self.assertEqual(self.device.check_disk(), ft.MSG_NO_DISK)
+		image_disk.wait_for_disk(self.device, 0.01)
+		other = self.image()
+		self.assertTrue(other.done)
+		self.assertEqual(len(list(self.store.jobs())), 2)
+		# the first disk comes back and its job carries on
+		self.sim.disk = self.disk
+		self.sim.eject()
+		image_disk.wait_for_disk(self.device, 0.01)
+		reads = self.sim.read_count
+		job = self.image()
+		self.assertNotEqual(job.path, other.path)
+		self.assertTrue(job.done)
+		self.assertEqual(self.sim.read_count, reads + 5)
+
+	def test_eject_while_imaging(self):
+		def log(message):
+			if message.startswith("c"):
+				self.sim.eject()
+		with self.assertRaises(image_disk.DiskChanged):
+			self.image(log)
+		self.assertEqual(self.sim.read_count, 1)
+
+
+if __name__ == "__main__":
+	unittest.main()
@@ -0,0 +1,46 @@
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+import random
+import unittest
+
+import mfm
+
+
+class MfmTest(unittest.TestCase):
+	def test_crc16(self):
+		self.assertEqual(mfm.crc16(b"123456789"), 0x29B1)
+		# an id field as a controller writes it, a1 a1 a1 fe 00 00 01 02
+		self.assertEqual(mfm.crc16(b"\xfe\x00\x00\x01\x02", mfm.SYNC_CRC), 0xCA6F)
+
+	def test_round_trip(self):
+		rng = random.Random(1)
+		data = [bytes(rng.randrange(256) for _ in range(256)) for _ in range(4)]
+		cells = mfm.encode_track(5, 1, data, 1, bad=[3])
+		intervals = mfm.cells_to_intervals(cells, 16.8, lambda: rng.randint(-3, 3))
+		sectors = mfm.decode_sectors(intervals, 16.8)
+		self.assertEqual(sorted(sectors), [(5, 1, number, 1) for number in range(1, 5)])
+		self.assertIsNone(sectors[(5, 1, 3, 1)])
+		for number in (1, 2, 4):
+			self.assertEqual(sectors[(5, 1, number, 1)], data[number - 1])
+		self.assertFalse(mfm.all_good(sectors))
+		again = mfm.decode_sectors(mfm.cells_to_intervals(mfm.encode_track(5, 1, data, 1), 16.8), 16.8)
+		self.assertTrue(mfm.all_good(mfm.merge_sectors(sectors, again)))
+		self.assertFalse(mfm.all_good({}))
+
+
+if __name__ == "__main__":
+	unittest.main()
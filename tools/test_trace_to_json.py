@@ -0,0 +1,116 @@
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+import io
+import os
+import time
+import tty
+import unittest
+
+import floppything as ft
+import simdevice
+import trace_to_json as tj
+
+
+def dump(events, cycles_per_second=1000000):
+	return (tj.HEADER.pack(ft.MSG_TRACE, len(events), cycles_per_second) +
+		b"".join(tj.EVENT.pack(cycles, event, value, 0) for cycles, event, value in events))
+
+
+class ReadDumpTest(unittest.TestCase):
+	def test_events(self):
+		events = [(10, tj.TRACE_STATE, 5), (20, tj.TRACE_USB_PACKET, 1)]
+		cycles_per_second, read = tj.read_dump(io.BytesIO(dump(events)).read)
+		self.assertEqual(cycles_per_second, 1000000)
+		self.assertEqual(read, [event + (0,) for event in events])
+
+	def test_without_trace(self):
+		with self.assertRaisesRegex(ValueError, "TRACE=0"):
+			tj.read_dump(io.BytesIO(bytes([ft.MSG_INVALID_CMD])).read)
+
+	def test_not_a_dump(self):
+		with self.assertRaises(ValueError):
+			tj.read_dump(io.BytesIO(bytes([ft.MSG_DONE])).read)
+
+	def test_cut_short(self):
+		with self.assertRaises(EOFError):
+			tj.read_dump(io.BytesIO(dump([(10, tj.TRACE_STATE, 5)])[:-1]).read)
+
+
+class TimelineTest(unittest.TestCase):
+	def test_phases(self):
+		timeline = tj.to_timeline(1000000, [
+			(100, tj.TRACE_INDEX_ENTER, 0, 0),
+			(101, tj.TRACE_INDEX_EDGE, 1, 0),
+			(102, tj.TRACE_INDEX_EXIT, 0, 0),
+			(200, tj.TRACE_STATE, 5, 0),
+			(300, 0x7f, 3, 0),
+		])["traceEvents"]
+		self.assertEqual([entry["ph"] for entry in timeline[:5]], ["B", "i", "E", "C", "i"])
+		self.assertEqual(timeline[3]["args"], {"state": 5})
+		self.assertEqual(timeline[1]["args"], {"value": 1})
+		self.assertEqual(timeline[4]["name"], "event 0x7f")
+		self.assertEqual(timeline[0]["ts"], 100.0)
+		# one thread per interrupt and the main loop, named in metadata
+		names = {entry["tid"]: entry["args"]["name"] for entry in timeline if entry["ph"] == "M"}
+		self.assertEqual(sorted(names.values()), ["index isr", "main loop", "unknown"])
+		for entry in timeline[:5]:
+			self.assertIn(entry["tid"], names)
+
+	def test_counter_wraps(self):
+		timeline = tj.to_timeline(1000000, [
+			(0xfffffff0, tj.TRACE_STATE, 5, 0),
+			(0x10, tj.TRACE_STATE, 0, 0),
+			(0x20, tj.TRACE_STATE, 5, 0),
+		])["traceEvents"]
+		times = [entry["ts"] for entry in timeline if entry["ph"] == "C"]
+		self.assertEqual(times[1] - times[0], 0x20)
+		self.assertEqual(times[2] - times[1], 0x10)
+
+
+class DeviceTest(unittest.TestCase):
+	def test_dump_from_simulator(self):
+		with simdevice.SimulatedDevice(simdevice.Disk.synthetic(cylinders=1)) as sim:
+			with ft.Link(sim.path) as link:
+				ft.Device(link).read_track(2)
+			cycles_per_second, events = tj.dump_from_device(sim.path)
+		self.assertEqual(cycles_per_second, simdevice.CYCLES_PER_SECOND)
+		kinds = [event for _, event, _, _ in events]
+		self.assertEqual(kinds.count(tj.TRACE_INDEX_EDGE), 6)
+		self.assertIn(tj.TRACE_USB_PACKET, kinds)
+		states = [value for _, event, value, _ in events if event == tj.TRACE_STATE]
+		self.assertEqual(states, [simdevice.STATE_READ, simdevice.STATE_DONE])
+
+	def test_simulator_without_trace(self):
+		with simdevice.SimulatedDevice(simdevice.Disk.synthetic(cylinders=1), trace=False) as sim:
+			with self.assertRaisesRegex(ValueError, "TRACE=0"):
+				tj.dump_from_device(sim.path)
+
+	def test_silent_board_times_out(self):
+		master, slave = os.openpty()
+		try:
+			tty.setraw(slave)
+			started = time.monotonic()
+			with self.assertRaises(TimeoutError):
+				tj.dump_from_device(os.ttyname(slave), timeout=0.2)
+			self.assertLess(time.monotonic() - started, 2)
+		finally:
+			os.close(master)
+			os.close(slave)
+
+
+if __name__ == "__main__":
+	unittest.main()
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+#	This file is part of floppyThing, a floppy imaging tool.
+#	Copyright 2020 Mads Thore Theodor Hansen
+#
+#	floppyThing is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	floppyThing is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Turns a firmware trace dump into a Chrome trace json timeline, which
+can be opened in chrome://tracing or ui.perfetto.dev.
+
+The input is either a file holding the raw reply to CMD_TRACE_DUMP, or
+the serial device of the board, in which case the dump is requested.
+
+	trace_to_json.py /dev/ttyACM0 -o trace.json
+"""
+
+import argparse
+import json
+import os
+import stat
+import struct
+import sys
+
+import floppything as ft
+
+#	events, keep in sync with trace.h
+TRACE_INDEX_ENTER = 0x01
+TRACE_INDEX_EXIT = 0x02
+TRACE_READDATA_ENTER = 0x03
+TRACE_READDATA_EXIT = 0x04
+TRACE_TIM3_ENTER = 0x05
+TRACE_TIM3_EXIT = 0x06
+TRACE_TIM2_ENTER = 0x07
+TRACE_TIM2_EXIT = 0x08
+TRACE_STATE = 0x10
+TRACE_USB_PACKET = 0x11
+TRACE_INDEX_EDGE = 0x12
+
+TRACE_SIZE = 256		# events the ring holds
+
+#	event: (name, thread, phase)
+EVENTS = {
+	TRACE_INDEX_ENTER: ("index", "index isr", "B"),
+	TRACE_INDEX_EXIT: ("index", "index isr", "E"),
+	TRACE_READDATA_ENTER: ("read data", "read data isr", "B"),
+	TRACE_READDATA_EXIT: ("read data", "read data isr", "E"),
+	TRACE_TIM3_ENTER: ("overflow", "tim3 isr", "B"),
+	TRACE_TIM3_EXIT: ("overflow", "tim3 isr", "E"),
+	TRACE_TIM2_ENTER: ("window", "tim2 isr", "B"),
+	TRACE_TIM2_EXIT: ("window", "tim2 isr", "E"),
+	TRACE_STATE: ("state", "main loop", "C"),
+	TRACE_USB_PACKET: ("usb packet", "main loop", "i"),
+	TRACE_INDEX_EDGE: ("index edge", "index isr", "i"),
+}
+
+TIMEOUT = 5.0		# seconds for the board to answer
+
+HEADER = struct.Struct("<BHI")
+EVENT = struct.Struct("<IBBH")
+
+
+def read_exactly(read, length):
+	data = b""
+	while len(data) < length:
+		chunk = read(length - len(data))
+		if not chunk:
+			raise EOFError("trace dump ended early")
+		data += chunk
+	return data
+
+
+def read_dump(read):
+	message = read_exactly(read, 1)
+	if message[0] == ft.MSG_INVALID_CMD:
+		raise ValueError("the firmware was built with TRACE=0")
+	if message[0] != ft.MSG_TRACE:
+		raise ValueError("not a trace dump, got 0x%02x" % message[0])
+	_, count, cycles_per_second = HEADER.unpack(message + read_exactly(read, HEADER.size - 1))
+	events = [EVENT.unpack(read_exactly(read, EVENT.size)) for _ in range(count)]
+	return cycles_per_second, events
+
+
+def dump_from_device(path, timeout=TIMEOUT):
+	"""Asks the board for its trace, raises TimeoutError if it goes quiet."""
+	with ft.Link(path, timeout) as link:
+		link.write([ft.CMD_TRACE_DUMP])
+		return read_dump(link.read)
+
+
+def dump_from_file(path):
+	with open(path, "rb") as dump:
+		return read_dump(dump.read)
+
+
+def to_timeline(cycles_per_second, events):
+	threads = {}
+	timeline = []
+	wraps = 0
+	last = None
+	for cycles, event, value, _ in events:
+		# the cycle counter is 32 bits and wraps, events are oldest first
+		if last is not None and cycles < last:
+			wraps += 1
+		last = cycles
+		name, thread, phase = EVENTS.get(event, ("event 0x%02x" % event, "unknown", "i"))
+		tid = threads.setdefault(thread, len(threads))
+		entry = {
+			"name": name,
+			"ph": phase,
+			"ts": ((wraps << 32) + cycles) * 1000000.0 / cycles_per_second,
+			"pid": 0,
+			"tid": tid,
+		}
+		if phase == "C":
+			entry["args"] = {name: value}
+		elif phase == "i":
+			entry["s"] = "t"
+			entry["args"] = {"value": value}
+		timeline.append(entry)
+	for thread, tid in threads.items():
+		timeline.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": tid,
+			"args": {"name": thread}})
+	return {"traceEvents": timeline, "displayTimeUnit": "ns"}
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+	parser.add_argument("input", help="trace dump file or serial device of the board")
+	parser.add_argument("-o", "--output", help="json file to write, default is stdout")
+	parser.add_argument("-t", "--timeout", type=float, default=TIMEOUT,
+		help="seconds to wait for the board, default %(default)s")
+	args = parser.parse_args()
+
+	try:
+		if stat.S_ISCHR(os.stat(args.input).st_mode):
+			cycles_per_second, events = dump_from_device(args.input, args.timeout)
+		else:
+			cycles_per_second, events = dump_from_file(args.input)
+	except (TimeoutError, EOFError, ValueError) as error:
+		sys.exit("%s: %s" % (args.input, error))
+	timeline = to_timeline(cycles_per_second, events)
+
+	if args.output:
+		with open(args.output, "w") as output:
+			json.dump(timeline, output, indent=1)
+	else:
+		json.dump(timeline, sys.stdout, indent=1)
+
+
+if __name__ == "__main__":
+	main()
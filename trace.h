@@ -0,0 +1,96 @@
+/*
+	This file is part of floppyThing, a floppy imaging tool.
+	Copyright 2020 Mads Thore Theodor Hansen
+
+    floppyThing is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    floppyThing is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with floppyThing.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Event trace ring, dumped with CMD_TRACE_DUMP and turned into a timeline
+by tools/trace_to_json.py. Set with TRACE in the makefile: 0 is off, 1
+traces everything but the per flux handlers, 2 adds the read data and
+timer overflow handlers, which fill the ring within a fraction of a
+revolution. The events are
+timestamped with DWT_CYCCNT on the STM32F4, and with clock() on other
+builds. */
+
+#include <stdint.h>
+
+#ifndef TRACE
+#define TRACE 0
+#endif
+
+//	events, keep in sync with tools/trace_to_json.py
+#define TRACE_INDEX_ENTER		0x01
+#define TRACE_INDEX_EXIT		0x02
+#define TRACE_READDATA_ENTER	0x03
+#define TRACE_READDATA_EXIT		0x04
+#define TRACE_TIM3_ENTER		0x05
+#define TRACE_TIM3_EXIT			0x06
+#define TRACE_TIM2_ENTER		0x07
+#define TRACE_TIM2_EXIT			0x08
+#define TRACE_STATE				0x10	// value is the new state
+#define TRACE_USB_PACKET		0x11	// value is the stream sent so far in 64 byte units, low 8 bits
+#define TRACE_INDEX_EDGE		0x12	// value is the index pin level
+
+#define TRACE_SIZE				256		// must be a power of two
+
+struct trace_event {
+	uint32_t cycles;
+	uint8_t event;
+	uint8_t value;
+	uint16_t reserved;
+};
+
+#if TRACE
+
+#ifdef STM32F4
+#include <libopencm3/cm3/dwt.h>
+#define TRACE_CYCLES()	DWT_CYCCNT
+#else
+#include <time.h>
+#define TRACE_CYCLES()	((uint32_t)clock())
+#endif
+
+struct trace_event trace_ring[TRACE_SIZE];
+uint32_t trace_position = 0;	// events added, masked when indexing
+volatile uint8_t trace_enabled = 1;	// off while the ring is dumped
+
+/* Can be called from the main loop and the interrupts, the position is
+taken atomically so an interrupted add never shares a slot. */
+static inline void trace_add(uint8_t event, uint8_t value)
+{
+	struct trace_event *slot;
+	
+	if(trace_enabled)
+	{
+		slot = &trace_ring[__atomic_fetch_add(&trace_position, 1, __ATOMIC_RELAXED) & (TRACE_SIZE - 1)];
+		slot->cycles = TRACE_CYCLES();
+		slot->event = event;
+		slot->value = value;
+	}
+}
+
+#define TRACE_EVENT(event, value)	trace_add(event, value)
+
+#else
+
+#define TRACE_EVENT(event, value)
+
+#endif
+
+#if TRACE > 1
+#define TRACE_EDGE(event)	trace_add(event, 0)
+#else
+#define TRACE_EDGE(event)
+#endif
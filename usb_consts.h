@@ -33,10 +33,13 @@ const struct usb_device_descriptor device_desc = {
 	.bNumConfigurations = 1,// number of configurations.
 };
 
+// filled in from the chip unique id at startup, so each board can be told apart
+char usb_serial[25] = "DEMO";
+
 const char *usb_strings[] = {
 	"Mushbie Technology",
 	"floppyThing",
-	"DEMO",
+	usb_serial,
 };
 
 